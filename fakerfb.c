@@ -0,0 +1,580 @@
+#include "vnc.h"
+#include "fakerfb.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#define FAKERFB_PIXEL_SIZE 4
+#define FAKERFB_SCROLL_LINES 16
+#define FAKERFB_DAMAGE_RECTS 4
+#define FAKERFB_DAMAGE_W 32
+#define FAKERFB_DAMAGE_H 16
+
+struct fakerfb
+{
+    fakerfb_cfg_t cfg;
+    int listener;
+    int client;
+    int stop;
+    pthread_t thread;
+    uint8_t *pixels;             // the whole screen, sent as is for raw rectangles
+    uint8_t *scratch;            // packed rows for rectangles narrower than the screen
+    unsigned int width;          // current size, changes with the resize workload
+    unsigned int height;
+    unsigned int scale;          // divisor the client asked for with rfbSetScale
+    int copyrect;                // client accepts copyrect
+    int newfbsize;               // client accepts resizes
+    unsigned int seed;
+    uint64_t next;               // earliest time the next update may go out
+    uint64_t bytes;
+    uint64_t updates;
+};
+
+static const char *workload_names[FAKERFB_NUM_WORKLOADS] =
+{
+    "raw",
+    "scroll",
+    "damage",
+    "resize",
+};
+
+const char *fakerfb_workload_name(fakerfb_workload_t workload)
+{
+    return workload < FAKERFB_NUM_WORKLOADS ? workload_names[workload] : "unknown";
+}
+
+static int srv_read(fakerfb_t *srv, void *out, size_t n)
+{
+    return recv(srv->client, out, n, MSG_WAITALL) == (ssize_t)n;
+}
+
+static int srv_skip(fakerfb_t *srv, size_t n)
+{
+    uint8_t buf[256];
+    size_t len;
+
+    while( n )
+    {
+        len = n < sizeof buf ? n : sizeof buf;
+        if( !srv_read(srv, buf, len) )
+        {
+            return 0;
+        }
+        n -= len;
+    }
+    return 1;
+}
+
+static int srv_write(fakerfb_t *srv, const void *data, size_t n)
+{
+    const uint8_t *buf = data;
+    ssize_t len;
+
+    while( n )
+    {
+        len = send(srv->client, buf, n, MSG_NOSIGNAL);
+        if( len <= 0 )
+        {
+            if( len < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            return 0;
+        }
+        buf += len;
+        n -= (size_t)len;
+        srv->bytes += (uint64_t)len;
+    }
+    return 1;
+}
+
+static int srv_rect_header(fakerfb_t *srv, unsigned int x, unsigned int y, unsigned int w, unsigned int h, uint32_t encoding)
+{
+    rfbFramebufferUpdateRectHeader rh;
+
+    rh.r.x = htons((uint16_t)x);
+    rh.r.y = htons((uint16_t)y);
+    rh.r.w = htons((uint16_t)w);
+    rh.r.h = htons((uint16_t)h);
+    rh.encoding = htonl(encoding);
+
+    return srv_write(srv, &rh, sz_rfbFramebufferUpdateRectHeader);
+}
+
+static int srv_raw(fakerfb_t *srv, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+    unsigned int stride = srv->cfg.width * FAKERFB_PIXEL_SIZE;
+    unsigned int len = w * FAKERFB_PIXEL_SIZE;
+    const uint8_t *src = srv->pixels + y * stride + x * FAKERFB_PIXEL_SIZE;
+    uint8_t *dst = srv->scratch;
+    unsigned int i;
+
+    if( !srv_rect_header(srv, x, y, w, h, rfbEncodingRaw) )
+    {
+        return 0;
+    }
+
+    // full width rows are already packed
+    if( len == stride )
+    {
+        return srv_write(srv, src, (size_t)len * h);
+    }
+
+    for( i = 0; i < h; i++ )
+    {
+        memcpy(dst, src, len);
+        dst += len;
+        src += stride;
+    }
+
+    return srv_write(srv, srv->scratch, (size_t)len * h);
+}
+
+static int srv_update_header(fakerfb_t *srv, unsigned int rects)
+{
+    rfbFramebufferUpdateMsg fu;
+
+    fu.type = rfbFramebufferUpdate;
+    fu.pad = 0;
+    fu.nRects = htons((uint16_t)rects);
+
+    srv->updates++;
+    return srv_write(srv, &fu, sz_rfbFramebufferUpdateMsg);
+}
+
+// change some pixels so consecutive frames aren't identical
+static void srv_animate(fakerfb_t *srv)
+{
+    unsigned int i;
+
+    for( i = 0; i < srv->cfg.width * FAKERFB_PIXEL_SIZE; i += FAKERFB_PIXEL_SIZE )
+    {
+        srv->pixels[i] = (uint8_t)(srv->updates + i);
+    }
+}
+
+// waits for the next slot when the rate is limited
+static void srv_pace(fakerfb_t *srv)
+{
+    uint64_t now, interval;
+
+    if( !srv->cfg.fps )
+    {
+        return;
+    }
+
+    interval = 1000000000ULL / srv->cfg.fps;
+    now = vnc_time_ns();
+    if( srv->next > now )
+    {
+        vnc_sleep_ms((unsigned int)((srv->next - now) / 1000000));
+        srv->next += interval;
+    }
+    else
+    {
+        srv->next = now + interval;
+    }
+}
+
+static int srv_update(fakerfb_t *srv, int incremental)
+{
+    rfbCopyRect cr;
+    unsigned int i, x, y;
+
+    srv_pace(srv);
+    srv_animate(srv);
+
+    if( !incremental )
+    {
+        return srv_update_header(srv, 1) && srv_raw(srv, 0, 0, srv->width, srv->height);
+    }
+
+    switch( srv->cfg.workload )
+    {
+        default:
+        case FAKERFB_RAW:
+            return srv_update_header(srv, 1) && srv_raw(srv, 0, 0, srv->width, srv->height);
+
+        case FAKERFB_SCROLL:
+            if( !srv->copyrect || srv->height <= FAKERFB_SCROLL_LINES )
+            {
+                return srv_update_header(srv, 1) && srv_raw(srv, 0, 0, srv->width, srv->height);
+            }
+            if( !srv_update_header(srv, 2) ||
+                !srv_rect_header(srv, 0, 0, srv->width, srv->height - FAKERFB_SCROLL_LINES, rfbEncodingCopyRect) )
+            {
+                return 0;
+            }
+            cr.srcX = htons(0);
+            cr.srcY = htons(FAKERFB_SCROLL_LINES);
+            if( !srv_write(srv, &cr, sz_rfbCopyRect) )
+            {
+                return 0;
+            }
+            return srv_raw(srv, 0, srv->height - FAKERFB_SCROLL_LINES, srv->width, FAKERFB_SCROLL_LINES);
+
+        case FAKERFB_DAMAGE:
+            if( !srv_update_header(srv, FAKERFB_DAMAGE_RECTS) )
+            {
+                return 0;
+            }
+            for( i = 0; i < FAKERFB_DAMAGE_RECTS; i++ )
+            {
+                x = (unsigned int)rand_r(&srv->seed) % (srv->width - FAKERFB_DAMAGE_W + 1);
+                y = (unsigned int)rand_r(&srv->seed) % (srv->height - FAKERFB_DAMAGE_H + 1);
+                if( !srv_raw(srv, x, y, FAKERFB_DAMAGE_W, FAKERFB_DAMAGE_H) )
+                {
+                    return 0;
+                }
+            }
+            return 1;
+
+        case FAKERFB_RESIZE:
+            if( !srv->newfbsize )
+            {
+                return srv_update_header(srv, 1) && srv_raw(srv, 0, 0, srv->width, srv->height);
+            }
+            if( srv->width == srv->cfg.width / srv->scale )
+            {
+                srv->width = srv->cfg.width / srv->scale / 2;
+                srv->height = srv->cfg.height / srv->scale / 2;
+            }
+            else
+            {
+                srv->width = srv->cfg.width / srv->scale;
+                srv->height = srv->cfg.height / srv->scale;
+            }
+            return srv_update_header(srv, 2) &&
+                   srv_rect_header(srv, 0, 0, srv->width, srv->height, rfbEncodingNewFBSize) &&
+                   srv_raw(srv, 0, 0, srv->width, srv->height);
+    }
+}
+
+// serves the top left of the screen at the scaled size, the pixels don't matter
+static int srv_scale(fakerfb_t *srv, unsigned int scale)
+{
+    rfbResizeFrameBufferMsg rs;
+
+    if( !scale || srv->cfg.width / scale < FAKERFB_DAMAGE_W || srv->cfg.height / scale < FAKERFB_DAMAGE_H )
+    {
+        return 1;
+    }
+
+    srv->scale = scale;
+    srv->width = srv->cfg.width / scale;
+    srv->height = srv->cfg.height / scale;
+
+    rs.type = rfbResizeFrameBuffer;
+    rs.pad1 = 0;
+    rs.framebufferWidth = htons((uint16_t)srv->width);
+    rs.framebufferHeigth = htons((uint16_t)srv->height);
+
+    return srv_write(srv, &rs, sz_rfbResizeFrameBufferMsg);
+}
+
+static int srv_handshake(fakerfb_t *srv)
+{
+    static const char name[] = "fakerfb";
+    rfbProtocolVersionMsg pv;
+    rfbServerInitMsg si;
+    uint8_t sec[2] = { 1, rfbSecTypeNone };
+    uint32_t result = 0;
+    uint8_t byte;
+
+    sprintf(pv, rfbProtocolVersionFormat, 3, 8);
+    if( !srv_write(srv, pv, sz_rfbProtocolVersionMsg) || !srv_read(srv, pv, sz_rfbProtocolVersionMsg) )
+    {
+        return 0;
+    }
+
+    if( !srv_write(srv, sec, sizeof sec) || !srv_read(srv, &byte, 1) ||
+        !srv_write(srv, &result, sizeof result) || !srv_read(srv, &byte, 1) )
+    {
+        return 0;
+    }
+
+    memset(&si, 0, sizeof si);
+    si.framebufferWidth = htons((uint16_t)srv->width);
+    si.framebufferHeight = htons((uint16_t)srv->height);
+    si.format.bitsPerPixel = 32;
+    si.format.depth = 24;
+    si.format.bigEndian = 0;
+    si.format.trueColour = 1;
+    si.format.redMax = htons(255);
+    si.format.greenMax = htons(255);
+    si.format.blueMax = htons(255);
+    si.format.redShift = 16;
+    si.format.greenShift = 8;
+    si.format.blueShift = 0;
+    si.nameLength = htonl(sizeof name - 1);
+
+    return srv_write(srv, &si, sz_rfbServerInitMsg) && srv_write(srv, name, sizeof name - 1);
+}
+
+// answers client messages until it goes away
+static void srv_serve(fakerfb_t *srv)
+{
+    uint8_t msg[sz_rfbFramebufferUpdateRequestMsg];
+    uint32_t encoding;
+    uint16_t count;
+    uint32_t len;
+
+    srv->width = srv->cfg.width;
+    srv->height = srv->cfg.height;
+    srv->scale = 1;
+    srv->copyrect = 0;
+    srv->newfbsize = 0;
+    srv->next = 0;
+
+    if( !srv_handshake(srv) )
+    {
+        return;
+    }
+
+    while( !srv->stop && srv_read(srv, msg, 1) )
+    {
+        switch( msg[0] )
+        {
+            case rfbSetPixelFormat:
+                if( !srv_skip(srv, sz_rfbSetPixelFormatMsg - 1) )
+                {
+                    return;
+                }
+                break;
+            case rfbSetEncodings:
+                if( !srv_read(srv, msg + 1, sz_rfbSetEncodingsMsg - 1) )
+                {
+                    return;
+                }
+                memcpy(&count, msg + 2, sizeof count);
+                count = ntohs(count);
+                while( count-- )
+                {
+                    if( !srv_read(srv, &encoding, sizeof encoding) )
+                    {
+                        return;
+                    }
+                    encoding = ntohl(encoding);
+                    srv->copyrect |= encoding == rfbEncodingCopyRect;
+                    srv->newfbsize |= encoding == rfbEncodingNewFBSize;
+                }
+                break;
+            case rfbFramebufferUpdateRequest:
+                if( !srv_read(srv, msg + 1, sz_rfbFramebufferUpdateRequestMsg - 1) || !srv_update(srv, msg[1]) )
+                {
+                    return;
+                }
+                break;
+            case rfbSetScale:
+                if( !srv->cfg.scaling )
+                {
+                    fprintf(stderr, "fakerfb: unexpected message %u.\n", msg[0]);
+                    return;
+                }
+                if( !srv_read(srv, msg + 1, sz_rfbSetScaleMsg - 1) || !srv_scale(srv, msg[1]) )
+                {
+                    return;
+                }
+                break;
+            case rfbKeyEvent:
+                if( !srv_skip(srv, sz_rfbKeyEventMsg - 1) )
+                {
+                    return;
+                }
+                break;
+            case rfbPointerEvent:
+                if( !srv_skip(srv, sz_rfbPointerEventMsg - 1) )
+                {
+                    return;
+                }
+                break;
+            case rfbClientCutText:
+                if( !srv_read(srv, msg + 1, 7) )
+                {
+                    return;
+                }
+                memcpy(&len, msg + 4, sizeof len);
+                if( !srv_skip(srv, ntohl(len)) )
+                {
+                    return;
+                }
+                break;
+            default:
+                fprintf(stderr, "fakerfb: unexpected message %u.\n", msg[0]);
+                return;
+        }
+    }
+}
+
+static void *srv_thread(void *arg)
+{
+    fakerfb_t *srv = arg;
+
+    while( !srv->stop )
+    {
+        srv->client = accept(srv->listener, NULL, NULL);
+        if( srv->client < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            break;
+        }
+
+        srv_serve(srv);
+
+        close(srv->client);
+        srv->client = -1;
+    }
+
+    return NULL;
+}
+
+static int srv_listen(fakerfb_t *srv)
+{
+    if( srv->cfg.path )
+    {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, srv->cfg.path, sizeof(addr.sun_path) - 1);
+        unlink(srv->cfg.path);
+
+        srv->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if( srv->listener < 0 || bind(srv->listener, (struct sockaddr*)&addr, sizeof addr) < 0 )
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        struct sockaddr_in addr;
+        int one = 1;
+
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(srv->cfg.port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        srv->listener = socket(AF_INET, SOCK_STREAM, 0);
+        if( srv->listener < 0 )
+        {
+            return 0;
+        }
+        setsockopt(srv->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        if( bind(srv->listener, (struct sockaddr*)&addr, sizeof addr) < 0 )
+        {
+            return 0;
+        }
+    }
+
+    return listen(srv->listener, 1) == 0;
+}
+
+fakerfb_t *fakerfb_start(const fakerfb_cfg_t *cfg)
+{
+    size_t size = (size_t)cfg->width * cfg->height * FAKERFB_PIXEL_SIZE;
+    fakerfb_t *srv;
+    size_t i;
+
+    if( !cfg->width || !cfg->height || size > VNC_BUF_SIZE ||
+        cfg->width < FAKERFB_DAMAGE_W || cfg->height < FAKERFB_DAMAGE_H )
+    {
+        return NULL;
+    }
+
+    srv = calloc(1, sizeof *srv);
+    if( !srv )
+    {
+        return NULL;
+    }
+
+    srv->cfg = *cfg;
+    srv->listener = -1;
+    srv->client = -1;
+    srv->seed = 1;
+    srv->pixels = malloc(size);
+    srv->scratch = malloc(size);
+    if( !srv->pixels || !srv->scratch )
+    {
+        fakerfb_stop(srv);
+        return NULL;
+    }
+
+    // something that isn't flat, so nothing along the way can cheat
+    for( i = 0; i < size; i++ )
+    {
+        srv->pixels[i] = (uint8_t)(i * 2654435761u >> 24);
+    }
+
+    if( !srv_listen(srv) )
+    {
+        fprintf(stderr, "fakerfb: could not listen: %s\n", strerror(errno));
+        fakerfb_stop(srv);
+        return NULL;
+    }
+
+    if( pthread_create(&srv->thread, NULL, srv_thread, srv) )
+    {
+        fakerfb_stop(srv);
+        return NULL;
+    }
+
+    return srv;
+}
+
+void fakerfb_stop(fakerfb_t *srv)
+{
+    if( !srv )
+    {
+        return;
+    }
+
+    srv->stop = 1;
+    if( srv->listener >= 0 )
+    {
+        shutdown(srv->listener, SHUT_RDWR);
+    }
+    if( srv->client >= 0 )
+    {
+        shutdown(srv->client, SHUT_RDWR);
+    }
+    if( srv->thread )
+    {
+        pthread_join(srv->thread, NULL);
+    }
+    if( srv->listener >= 0 )
+    {
+        close(srv->listener);
+    }
+    if( srv->cfg.path )
+    {
+        unlink(srv->cfg.path);
+    }
+
+    free(srv->pixels);
+    free(srv->scratch);
+    free(srv);
+}
+
+uint64_t fakerfb_bytes(fakerfb_t *srv)
+{
+    return srv->bytes;
+}
+
+uint64_t fakerfb_updates(fakerfb_t *srv)
+{
+    return srv->updates;
+}
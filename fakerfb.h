@@ -0,0 +1,48 @@
+#ifndef FAKERFB_H
+#define FAKERFB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// synthetic rfb 3.8 server for exercising the client without a vm
+// serves one client at a time from a background thread, answering every
+// update request with the configured workload
+
+typedef enum
+{
+    FAKERFB_RAW = 0,             // the whole screen as raw pixels
+    FAKERFB_SCROLL,              // copyrect scroll with a raw strip uncovered at the bottom
+    FAKERFB_DAMAGE,              // a few small raw rectangles, like a cursor or typing
+    FAKERFB_RESIZE,              // alternates between full and half size
+    FAKERFB_NUM_WORKLOADS
+}
+fakerfb_workload_t;
+
+typedef struct
+{
+    const char *path;            // unix socket to listen on, or NULL for tcp
+    uint16_t port;               // tcp port on 127.0.0.1 when path is NULL
+    unsigned int width;
+    unsigned int height;
+    unsigned int fps;            // most updates per second, 0 answers requests immediately
+    fakerfb_workload_t workload;
+    int scaling;                 // honours rfbSetScale, otherwise the client is dropped like old servers do
+}
+fakerfb_cfg_t;
+
+typedef struct fakerfb fakerfb_t;
+
+fakerfb_t *fakerfb_start(const fakerfb_cfg_t *cfg);
+void fakerfb_stop(fakerfb_t *srv);
+uint64_t fakerfb_bytes(fakerfb_t *srv);
+uint64_t fakerfb_updates(fakerfb_t *srv);
+const char *fakerfb_workload_name(fakerfb_workload_t workload);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,26 @@
+# the rfb client core as a library, for linking into encoders and monitors
+# build with: qmake libvncxfer.pro && make
+# add CONFIG+=staticlib on the qmake command line for a static archive
+
+CONFIG -= qt
+
+isEmpty(TARGET_NAME) {
+    TARGET_NAME = vncxfer
+}
+TARGET = $$TARGET_NAME
+TEMPLATE = lib
+VERSION = 1.0.0
+
+include(common.pri)
+
+# only the vncxfer_* interface is exported
+DEFINES += VNCXFER_BUILD
+QMAKE_CFLAGS += -fvisibility=hidden
+
+SOURCES += \
+    vncxfer.c \
+    $$CORE_SOURCES
+
+HEADERS  += \
+    vncxfer.h \
+    $$CORE_HEADERS
@@ -0,0 +1,283 @@
+#include "vnc.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// leveled logging that never blocks a display thread
+// messages are formatted by the caller into a bounded lock-free queue and
+// written out by one background thread, if the queue is full they are dropped
+// the writer sleeps on a condition variable while the queue is empty, producers
+// only take its lock to wake it, which happens once per idle period
+
+typedef struct
+{
+    uint64_t seq;                // which lap of the ring the slot is ready for
+    int level;
+    char text[VNC_LOG_LINE];
+}
+log_slot_t;
+
+static struct
+{
+    log_slot_t slots[VNC_LOG_SLOTS];
+    uint64_t head;               // next slot the writer reads
+    uint64_t tail;               // next slot a producer claims
+    uint64_t dropped;            // messages lost because the queue was full
+    int level;
+    int sleeping;                // the writer is waiting, or about to, for a message
+    pthread_mutex_t lock;
+    pthread_cond_t ready;        // a message was queued while the writer slept
+    pthread_cond_t drained;      // the writer caught up, for vnc_log_flush
+    pthread_once_t once;
+}
+logger = { .level = VNC_LOG_INFO, .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER,
+           .drained = PTHREAD_COND_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+static const char *const log_levels[] = { "error", "warning", "info", "debug" };
+
+// whether there is anything for the writer to do
+static int log_pending(uint64_t reported)
+{
+    const log_slot_t *slot = &logger.slots[logger.head % VNC_LOG_SLOTS];
+
+    return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == logger.head + 1 ||
+           __atomic_load_n(&logger.dropped, __ATOMIC_SEQ_CST) != reported;
+}
+
+static void *log_thread(void *arg)
+{
+    uint64_t dropped, reported = 0;
+    log_slot_t *slot;
+    int wrote;
+
+    (void)arg;
+
+    while( 1 )
+    {
+        wrote = 0;
+
+        while( 1 )
+        {
+            slot = &logger.slots[logger.head % VNC_LOG_SLOTS];
+            if( __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logger.head + 1 )
+            {
+                break;
+            }
+
+            fputs(slot->text, slot->level <= VNC_LOG_WARN ? stderr : stdout);
+            __atomic_store_n(&slot->seq, logger.head + VNC_LOG_SLOTS, __ATOMIC_RELEASE);
+            __atomic_store_n(&logger.head, logger.head + 1, __ATOMIC_RELEASE);
+            wrote = 1;
+        }
+
+        dropped = __atomic_load_n(&logger.dropped, __ATOMIC_RELAXED);
+        if( dropped != reported )
+        {
+            fprintf(stderr, "log queue full, %lu messages dropped.\n", (unsigned long)(dropped - reported));
+            reported = dropped;
+            wrote = 1;
+        }
+
+        if( wrote )
+        {
+            fflush(stdout);
+            fflush(stderr);
+        }
+
+        // announce the sleep before the last look at the queue, a producer that
+        // published after that look sees the flag and wakes us under the lock
+        pthread_mutex_lock(&logger.lock);
+        pthread_cond_broadcast(&logger.drained);
+        __atomic_store_n(&logger.sleeping, 1, __ATOMIC_SEQ_CST);
+        while( !log_pending(reported) )
+        {
+            pthread_cond_wait(&logger.ready, &logger.lock);
+        }
+        __atomic_store_n(&logger.sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&logger.lock);
+    }
+
+    return NULL;
+}
+
+static void log_start(void)
+{
+    pthread_t thread;
+    unsigned int i;
+
+    for( i = 0; i < VNC_LOG_SLOTS; i++ )
+    {
+        logger.slots[i].seq = i;
+    }
+
+    if( pthread_create(&thread, NULL, log_thread, NULL) == 0 )
+    {
+        pthread_detach(thread);
+    }
+}
+
+// wakes the writer if it is waiting for messages
+static void log_wake(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if( __atomic_load_n(&logger.sleeping, __ATOMIC_SEQ_CST) )
+    {
+        pthread_mutex_lock(&logger.lock);
+        pthread_cond_signal(&logger.ready);
+        pthread_mutex_unlock(&logger.lock);
+    }
+}
+
+void vnc_log_level(int level)
+{
+    __atomic_store_n(&logger.level, level, __ATOMIC_RELAXED);
+}
+
+// token bucket per display, so a flapping vm can't flood the log
+// returns 0 if the message should be suppressed
+static int log_allowed(vnc_t *vnc)
+{
+    uint64_t interval = 1000000000ULL / VNC_LOG_RATE;
+    uint64_t now = vnc_time_ns();
+
+    vnc->log_credit += now - vnc->log_time;
+    vnc->log_time = now;
+    if( vnc->log_credit > VNC_LOG_BURST * interval )
+    {
+        vnc->log_credit = VNC_LOG_BURST * interval;
+    }
+
+    if( vnc->log_credit < interval )
+    {
+        vnc->log_suppressed++;
+        return 0;
+    }
+
+    vnc->log_credit -= interval;
+    return 1;
+}
+
+void vnc_log(vnc_t *vnc, int level, const char *fmt, ...)
+{
+    unsigned int suppressed = 0;
+    log_slot_t *slot;
+    uint64_t pos, seq;
+    va_list ap;
+    size_t n = 0;
+    int len;
+
+    if( level > __atomic_load_n(&logger.level, __ATOMIC_RELAXED) )
+    {
+        return;
+    }
+
+    if( vnc )
+    {
+        if( !log_allowed(vnc) )
+        {
+            return;
+        }
+        suppressed = vnc->log_suppressed;
+        vnc->log_suppressed = 0;
+    }
+
+    pthread_once(&logger.once, log_start);
+
+    // claim a slot, the ring is a bounded multi producer queue
+    pos = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+    while( 1 )
+    {
+        slot = &logger.slots[pos % VNC_LOG_SLOTS];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if( seq == pos )
+        {
+            if( __atomic_compare_exchange_n(&logger.tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+            {
+                break;
+            }
+        }
+        else if( (int64_t)(seq - pos) < 0 )
+        {
+            __atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+            log_wake();
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->level = level;
+
+    if( vnc && vnc->cfg.uuid )
+    {
+        len = snprintf(slot->text, VNC_LOG_LINE, "%s: %s: ", vnc->cfg.uuid, log_levels[level]);
+    }
+    else
+    {
+        len = snprintf(slot->text, VNC_LOG_LINE, "%s: ", log_levels[level]);
+    }
+    n = len > 0 ? (size_t)len : 0;
+
+    if( n < VNC_LOG_LINE )
+    {
+        va_start(ap, fmt);
+        len = vsnprintf(slot->text + n, VNC_LOG_LINE - n, fmt, ap);
+        va_end(ap);
+        n += len > 0 ? (size_t)len : 0;
+    }
+
+    // every message is one line, whether or not the format ended in a newline
+    if( n > VNC_LOG_LINE - 2 )
+    {
+        n = VNC_LOG_LINE - 2;
+    }
+    while( n && slot->text[n - 1] == '\n' )
+    {
+        n--;
+    }
+    if( suppressed )
+    {
+        len = snprintf(slot->text + n, VNC_LOG_LINE - 1 - n, " (%u messages suppressed)", suppressed);
+        n += len > 0 ? (size_t)len : 0;
+        if( n > VNC_LOG_LINE - 2 )
+        {
+            n = VNC_LOG_LINE - 2;
+        }
+    }
+    slot->text[n] = '\n';
+    slot->text[n + 1] = 0;
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    log_wake();
+}
+
+// waits until everything queued so far has been written, for use before exiting
+void vnc_log_flush(void)
+{
+    uint64_t tail = __atomic_load_n(&logger.tail, __ATOMIC_ACQUIRE);
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += VNC_LOG_FLUSH_MS / 1000;
+    deadline.tv_nsec += (VNC_LOG_FLUSH_MS % 1000) * 1000000L;
+    if( deadline.tv_nsec >= 1000000000L )
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&logger.lock);
+    while( __atomic_load_n(&logger.head, __ATOMIC_ACQUIRE) < tail )
+    {
+        if( pthread_cond_timedwait(&logger.drained, &logger.lock, &deadline) )
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&logger.lock);
+}
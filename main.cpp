@@ -1,8 +1,13 @@
 #include <QApplication>
 #include <QMainWindow>
 #include <QPainter>
-#include <QTime>
+#include <QTimer>
+#include <QSocketNotifier>
+#include <QFileSystemWatcher>
+#include <QFileInfo>
 #include <QShortcut>
+#include <QPaintEvent>
+#include <QtMath>
 #include "vnc.h"
 
 #include <sys/stat.h>
@@ -12,6 +17,10 @@
 #define VNC_HRES 1280
 #define VNC_VRES 1024
 
+// shows the guest at 1/2, 1/4 or 1/8 of its size, like one tile of a wall of thumbnails
+// the small image comes from the mip levels kept up to date from damage, not from scaling on paint
+#define VNC_MIP_LEVEL 0
+
 #ifdef VNC_TCP
 #define VNC_PATH "127.0.0.1"
 #define VNC_PORT 5900
@@ -22,49 +31,288 @@
 
 class Screen : public QWidget {
 protected:
-    virtual void paintEvent(QPaintEvent *)
+    virtual void paintEvent(QPaintEvent *e)
     {
         QPainter c(this);
         const QRect& cw = c.window();
-        c.drawImage(cw, m_image);
+
+        if( m_image.isNull() || cw.isEmpty() )
+        {
+            return;
+        }
+
+        // only repaint the parts of the image behind the exposed region
+        // regions are iterable since 5.8, rects() is deprecated after that
+#if QT_VERSION >= QT_VERSION_CHECK(5, 8, 0)
+        const QRegion& region = e->region();
+        for( QRegion::const_iterator r = region.begin(); r != region.end(); ++r )
+        {
+            QRect src = toImage(*r, cw);
+            c.drawImage(toWidget(src, cw), m_image, QRectF(src));
+        }
+#else
+        foreach( const QRect& r, e->region().rects() )
+        {
+            QRect src = toImage(r, cw);
+            c.drawImage(toWidget(src, cw), m_image, QRectF(src));
+        }
+#endif
+
+        // the server keeps the cursor out of the framebuffer, so it goes on top
+        if( !m_cursor.isNull() )
+        {
+            c.drawImage(toWidget(m_cursorRect, cw), m_cursor);
+        }
     }
 public:
     void refresh(vnc_t *vnc)
     {
-        memcpy(m_image.bits() + vnc->status.update_offset, vnc->buf + vnc->status.update_offset, static_cast<size_t>(vnc->status.update_size));
-        update();
+        const QRect& cw = rect();
+        const uint8_t *pixels = vnc_pixels(vnc);
+        unsigned int stride = vnc->server.stride;
+        unsigned int pixelsize = vnc->server.pixelsize;
+
+        if( VNC_MIP_LEVEL )
+        {
+            const vnc_mip_level_t *mip = vnc_mip(vnc, VNC_MIP_LEVEL);
+            if( !mip )
+            {
+                return;
+            }
+            pixels = mip->pixels;
+            stride = mip->stride;
+        }
+
+        for( unsigned int i = 0; i < vnc->status.num_damage; i++ )
+        {
+            const vnc_rect_t& d = vnc->status.damage[i];
+            QRect r = toLevel(QRect(d.x, d.y, d.w, d.h)).intersected(m_image.rect());
+            size_t len = static_cast<size_t>(r.width()) * pixelsize;
+
+            if( r.isEmpty() )
+            {
+                continue;
+            }
+
+            for( int y = r.top(); y <= r.bottom(); y++ )
+            {
+                memcpy(m_image.scanLine(y) + r.x() * pixelsize, pixels + y * stride + r.x() * pixelsize, len);
+            }
+
+            // pad by a pixel so smooth scaling doesn't leave seams at the edges
+            update(toWidget(r, cw).toAlignedRect().adjusted(-1, -1, 1, 1));
+        }
+    }
+    void cursor(vnc_t *vnc)
+    {
+        const vnc_cursor_t& c = vnc->cursor;
+        const QRect& cw = rect();
+        QRect old = m_cursorRect;
+
+        // only rebuild the image when the shape changed, moves are just a repaint
+        if( c.serial != m_cursorSerial )
+        {
+            m_cursorSerial = c.serial;
+            m_cursor = QImage();
+            if( c.width && vnc->server.pixelsize == 4 )
+            {
+                m_cursor = QImage(c.width, c.height, QImage::Format_RGBA8888);
+                for( unsigned int y = 0; y < c.height; y++ )
+                {
+                    uchar *line = m_cursor.scanLine(y);
+                    for( unsigned int x = 0; x < c.width; x++ )
+                    {
+                        memcpy(line + x * 4, c.pixels + (y * c.width + x) * 4, 3);
+                        line[x * 4 + 3] = c.mask[y * c.width + x];
+                    }
+                }
+            }
+        }
+
+        m_cursorRect = m_cursor.isNull() ? QRect() : toLevel(QRect(static_cast<int>(c.x - c.hotx), static_cast<int>(c.y - c.hoty),
+                                                                    static_cast<int>(c.width), static_cast<int>(c.height)));
+        if( old != m_cursorRect )
+        {
+            if( !old.isNull() )
+            {
+                update(toWidget(old, cw).toAlignedRect().adjusted(-1, -1, 1, 1));
+            }
+            if( !m_cursorRect.isNull() )
+            {
+                update(toWidget(m_cursorRect, cw).toAlignedRect().adjusted(-1, -1, 1, 1));
+            }
+        }
     }
     void setsize(int w, int h)
     {
         m_w = w;
         m_h = h;
         m_image = QImage(m_w, m_h, QImage::Format_RGBX8888);
+        update();
     }
-    Screen(QWidget *parent = Q_NULLPTR) : QWidget(parent)
+    Screen(QWidget *parent = Q_NULLPTR) : QWidget(parent), m_cursorSerial(0)
     {
         setsize(0, 0);
         m_image.fill(Qt::white);
     }
 private:
+    // maps framebuffer pixels to the mip level shown, rounded outwards
+    static QRect toLevel(const QRect& r)
+    {
+        int f = 1 << VNC_MIP_LEVEL;
+        int x0 = r.x() >> VNC_MIP_LEVEL;
+        int y0 = r.y() >> VNC_MIP_LEVEL;
+        int x1 = (r.x() + r.width() + f - 1) >> VNC_MIP_LEVEL;
+        int y1 = (r.y() + r.height() + f - 1) >> VNC_MIP_LEVEL;
+        return QRect(QPoint(x0, y0), QPoint(x1 - 1, y1 - 1));
+    }
+    // maps an image rectangle to where it is drawn in the window
+    QRectF toWidget(const QRect& r, const QRect& cw) const
+    {
+        qreal sx = static_cast<qreal>(cw.width()) / m_w;
+        qreal sy = static_cast<qreal>(cw.height()) / m_h;
+        return QRectF(cw.x() + r.x() * sx, cw.y() + r.y() * sy, r.width() * sx, r.height() * sy);
+    }
+    // maps a window rectangle to the image pixels covering it, rounded outwards
+    QRect toImage(const QRect& r, const QRect& cw) const
+    {
+        qreal sx = static_cast<qreal>(m_w) / cw.width();
+        qreal sy = static_cast<qreal>(m_h) / cw.height();
+        int x0 = qFloor((r.x() - cw.x()) * sx);
+        int y0 = qFloor((r.y() - cw.y()) * sy);
+        int x1 = qCeil((r.x() + r.width() - cw.x()) * sx);
+        int y1 = qCeil((r.y() + r.height() - cw.y()) * sy);
+        return QRect(QPoint(x0, y0), QPoint(x1 - 1, y1 - 1)).intersected(m_image.rect());
+    }
     QImage m_image;
+    QImage m_cursor;
+    QRect m_cursorRect;          // where the cursor image goes, in image pixels, scaled to fit it
+    uint32_t m_cursorSerial;
     int m_w, m_h;
 };
 
-void update(vnc_t *vnc, QMainWindow &w, Screen &scrn)
-{
-    if( vnc->status.fbsize_updated )
+// drives a single connection from the event loop
+// retries are timer based and reads are driven by socket readiness, so an idle viewer sleeps
+class Viewer : public QObject {
+    Q_OBJECT
+public:
+    Viewer(vnc_t *vnc, QMainWindow &w, Screen &scrn) : m_vnc(vnc), m_w(w), m_scrn(scrn), m_notifier(Q_NULLPTR)
     {
-        vnc->status.fbsize_updated = 0;
-        w.setFixedSize(vnc->server.width, vnc->server.height);
-        scrn.setsize(vnc->server.width, vnc->server.height);
+        m_retry.setSingleShot(true);
+        connect(&m_retry, SIGNAL(timeout()), this, SLOT(attempt()));
+        m_tick.setSingleShot(true);
+        connect(&m_tick, SIGNAL(timeout()), this, SLOT(tick()));
+#ifndef VNC_TCP
+        // attach the moment the vm creates its socket instead of waiting for the timer
+        m_watcher.addPath(QFileInfo(VNC_PATH).absolutePath());
+        connect(&m_watcher, SIGNAL(directoryChanged(QString)), this, SLOT(changed()));
+#endif
     }
-    if( vnc->status.updated )
+    void start()
     {
-        vnc->status.updated = 0;
-        scrn.refresh(vnc);
+        // someone is looking at this one
+        vnc_attach(m_vnc);
+        vnc_vm_off(m_vnc);
+        show();
+        attempt();
     }
-    qApp->processEvents();
-}
+private slots:
+    void attempt()
+    {
+        int value = rfb_connect(m_vnc, static_cast<const char*>(VNC_PATH), VNC_PORT);
+        if( value == 0 )
+        {
+            // fatal, leave the last frame up
+            return;
+        }
+        if( value == 2 )
+        {
+            show();
+            m_retry.start(static_cast<int>(vnc_backoff_next(m_vnc)));
+            return;
+        }
+
+        m_notifier = new QSocketNotifier(m_vnc->sock, QSocketNotifier::Read, this);
+        connect(m_notifier, SIGNAL(activated(int)), this, SLOT(readable()));
+        show();
+        tick();
+    }
+    void readable()
+    {
+        if( !rfb_process(m_vnc) )
+        {
+            lost();
+            return;
+        }
+        show();
+        tick();
+    }
+    // paced and timed out update requests go out from here
+    void tick()
+    {
+        int timeout = rfb_tick(m_vnc);
+        if( timeout < 0 )
+        {
+            rfb_disconnect(m_vnc);
+            lost();
+            return;
+        }
+        m_tick.start(timeout);
+    }
+    void changed()
+    {
+        if( m_retry.isActive() && vnc_socket_exists(VNC_PATH) )
+        {
+            m_retry.stop();
+            attempt();
+        }
+    }
+private:
+    void lost()
+    {
+        // the socket is already closed at this point
+        m_tick.stop();
+        m_notifier->setEnabled(false);
+        m_notifier->deleteLater();
+        m_notifier = Q_NULLPTR;
+
+        vnc_log(m_vnc, VNC_LOG_INFO, "vnc connection lost.");
+
+        show();
+        QTimer::singleShot(0, this, SLOT(attempt()));
+    }
+    void show()
+    {
+        if( m_vnc->status.fbsize_updated )
+        {
+            unsigned int f = 1u << VNC_MIP_LEVEL;
+            int w = static_cast<int>((m_vnc->server.width + f - 1) / f);
+            int h = static_cast<int>((m_vnc->server.height + f - 1) / f);
+
+            m_vnc->status.fbsize_updated = 0;
+            m_w.setFixedSize(w, h);
+            m_scrn.setsize(w, h);
+        }
+        if( m_vnc->status.updated )
+        {
+            vnc_stats_published(m_vnc);
+            m_vnc->status.updated = 0;
+            m_scrn.refresh(m_vnc);
+        }
+        if( m_vnc->cursor.updated )
+        {
+            m_vnc->cursor.updated = 0;
+            m_scrn.cursor(m_vnc);
+        }
+    }
+    vnc_t *m_vnc;
+    QMainWindow &m_w;
+    Screen &m_scrn;
+    QSocketNotifier *m_notifier;
+    QTimer m_retry;
+    QTimer m_tick;
+    QFileSystemWatcher m_watcher;
+};
 
 int main(int argc, char *argv[])
 {
@@ -72,51 +320,15 @@ int main(int argc, char *argv[])
     QApplication a(argc, argv);
     QMainWindow w;
     Screen scrn;
-    int value;
+    Viewer viewer(&vnc, w, scrn);
 
     w.setCentralWidget(&scrn);
     w.setFixedSize(0, 0);
     w.show();
 
-    while( 1 )
-    {
-        vnc_vm_off(&vnc);
+    viewer.start();
 
-        while( 1 )
-        {
-            value = rfb_connect(&vnc, static_cast<const char*>(VNC_PATH), VNC_PORT);
-            if( value == 0 )
-            {
-                goto exit;
-            }
-            if( value == 1 )
-            {
-                break;
-            }
-            if( value == 2 )
-            {
-                update(&vnc, w, scrn);
-                QTime dt = QTime::currentTime().addMSecs(2000);
-                while (QTime::currentTime() < dt) {
-                    qApp->processEvents();
-                }
-                continue;
-            }
-        }
-
-        while( 1 )
-        {
-            if( !rfb_grab(&vnc, 0) )
-            {
-                break;
-            }
-            update(&vnc, w, scrn);
-        }
-
-        fprintf(stdout, "vnc connection lost.\n");
-        fflush(stdout);
-    }
-
-exit:
     return a.exec();
 }
+
+#include "main.moc"
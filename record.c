@@ -0,0 +1,506 @@
+#include "vnc.h"
+#include "record.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+// session recording
+// the decoder thread tees every message into a buffer, and full buffers are
+// handed to a writer thread so the disk never blocks decoding
+
+// a buffer of whole chunks waiting to be written
+typedef struct record_buf
+{
+    uint8_t *data;
+    size_t len;
+    size_t size;
+    struct record_buf *next;
+}
+record_buf_t;
+
+struct vnc_record
+{
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    record_buf_t *head;          // handed over, oldest first
+    record_buf_t *tail;
+    size_t queued;               // bytes handed over but not yet written
+    int stop;
+    record_buf_t *cur;           // being filled by the decoder thread
+    size_t chunk;                // offset of the open data chunk in cur
+    int open;                    // a data chunk is open
+    int need_keyframe;           // nothing since the last keyframe can be relied on
+    uint64_t last_keyframe;
+    uint64_t last_handover;
+    unsigned int keyframe_ms;
+    uint64_t dropped;            // bytes thrown away because the disk fell behind
+};
+
+static uint64_t record_wall_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int record_write(int fd, const uint8_t *data, size_t len)
+{
+    ssize_t n;
+
+    while( len )
+    {
+        n = write(fd, data, len);
+        if( n < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return 0;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static void *record_thread(void *arg)
+{
+    vnc_record_t *rec = arg;
+    record_buf_t *buf;
+    int failed = 0;
+
+    pthread_mutex_lock(&rec->lock);
+    while( 1 )
+    {
+        while( !rec->head && !rec->stop )
+        {
+            pthread_cond_wait(&rec->cond, &rec->lock);
+        }
+        if( !rec->head )
+        {
+            break;
+        }
+
+        buf = rec->head;
+        rec->head = buf->next;
+        if( !rec->head )
+        {
+            rec->tail = NULL;
+        }
+        pthread_mutex_unlock(&rec->lock);
+
+        if( !failed && !record_write(rec->fd, buf->data, buf->len) )
+        {
+            fprintf(stderr, "recording write failed: %s\n", strerror(errno));
+            failed = 1;
+        }
+
+        pthread_mutex_lock(&rec->lock);
+        rec->queued -= buf->len;
+        free(buf->data);
+        free(buf);
+    }
+    pthread_mutex_unlock(&rec->lock);
+
+    return NULL;
+}
+
+static record_buf_t *record_buf_new(void)
+{
+    record_buf_t *buf = calloc(1, sizeof *buf);
+    if( !buf )
+    {
+        return NULL;
+    }
+
+    buf->data = malloc(VNC_REC_BUF_SIZE);
+    if( !buf->data )
+    {
+        free(buf);
+        return NULL;
+    }
+    buf->size = VNC_REC_BUF_SIZE;
+
+    return buf;
+}
+
+static int record_reserve(record_buf_t *buf, size_t n)
+{
+    uint8_t *data;
+    size_t size = buf->size;
+
+    if( likely(buf->len + n <= size) )
+    {
+        return 1;
+    }
+
+    while( size < buf->len + n )
+    {
+        size *= 2;
+    }
+
+    data = realloc(buf->data, size);
+    if( !data )
+    {
+        return 0;
+    }
+
+    buf->data = data;
+    buf->size = size;
+    return 1;
+}
+
+// queues the current buffer for the writer, or drops it if the disk is too far behind
+static void record_handover(vnc_record_t *rec)
+{
+    record_buf_t *buf = rec->cur;
+    record_buf_t *next;
+
+    if( !buf || !buf->len )
+    {
+        return;
+    }
+
+    next = record_buf_new();
+    if( !next )
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&rec->lock);
+    if( rec->queued + buf->len > VNC_REC_MAX_QUEUED )
+    {
+        pthread_mutex_unlock(&rec->lock);
+        vnc_count(&rec->dropped, buf->len);
+        rec->need_keyframe = 1;
+        buf->len = 0;
+        free(next->data);
+        free(next);
+        return;
+    }
+    rec->queued += buf->len;
+    if( rec->tail )
+    {
+        rec->tail->next = buf;
+    }
+    else
+    {
+        rec->head = buf;
+    }
+    rec->tail = buf;
+    pthread_cond_signal(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+
+    rec->cur = next;
+    rec->last_handover = vnc_time_ns();
+}
+
+// adds a chunk header and returns where its payload goes
+static uint8_t *record_chunk(vnc_record_t *rec, uint32_t type, size_t len)
+{
+    vnc_rec_chunk_t hdr;
+    uint8_t *ptr;
+
+    if( !rec->cur || !record_reserve(rec->cur, sizeof hdr + len) )
+    {
+        return NULL;
+    }
+
+    hdr.type = type;
+    hdr.len = (uint32_t)len;
+    hdr.time = record_wall_ns();
+
+    ptr = rec->cur->data + rec->cur->len;
+    memcpy(ptr, &hdr, sizeof hdr);
+    rec->cur->len += sizeof hdr + len;
+
+    return ptr + sizeof hdr;
+}
+
+// a snapshot of the framebuffer playback can start from
+static void record_keyframe(vnc_record_t *rec, vnc_t *vnc)
+{
+    size_t row = (size_t)vnc->server.width * vnc->server.pixelsize;
+    unsigned int screens = vnc->status.num_screens;
+    vnc_rec_keyframe_t kf;
+    vnc_rec_screen_t scr;
+    const uint8_t *src;
+    uint8_t *dst;
+    unsigned int i, y;
+    size_t len;
+
+    // start from an empty buffer so the snapshot isn't stuck behind earlier data
+    record_handover(rec);
+
+    dst = record_chunk(rec, VNC_REC_KEYFRAME, sizeof kf + screens * sizeof scr + row * vnc->server.height);
+    if( !dst )
+    {
+        return;
+    }
+
+    memset(&kf, 0, sizeof kf);
+    kf.width = vnc->server.width;
+    kf.height = vnc->server.height;
+    kf.pixelsize = vnc->server.pixelsize;
+    kf.num_screens = screens;
+    memcpy(dst, &kf, sizeof kf);
+    dst += sizeof kf;
+
+    for( i = 0; i < screens; i++ )
+    {
+        scr.id = vnc->status.screens[i].id;
+        scr.x = vnc->status.screens[i].rect.x;
+        scr.y = vnc->status.screens[i].rect.y;
+        scr.width = vnc->status.screens[i].rect.w;
+        scr.height = vnc->status.screens[i].rect.h;
+        memcpy(dst, &scr, sizeof scr);
+        dst += sizeof scr;
+    }
+
+    src = vnc_framebuffer(vnc);
+    for( y = 0; y < vnc->server.height; y++ )
+    {
+        memcpy(dst, src, row);
+        src += vnc->server.stride;
+        dst += row;
+    }
+
+    // the cursor is only sent when it changes, so a keyframe brings it along as an update
+    if( !vnc->cfg.disable_cursor )
+    {
+        len = rfb_cursor_message(vnc, NULL);
+        dst = record_chunk(rec, VNC_REC_DATA, len);
+        if( dst )
+        {
+            rfb_cursor_message(vnc, dst);
+        }
+    }
+
+    rec->need_keyframe = 0;
+    rec->last_keyframe = vnc_time_ns();
+    record_handover(rec);
+}
+
+vnc_record_t *vnc_record_open(const char *path, const char *uuid, unsigned int keyframe_ms)
+{
+    vnc_rec_chunk_t hdr;
+    vnc_rec_start_t start;
+    vnc_record_t *rec;
+    uint8_t head[sizeof hdr + sizeof start];
+
+    rec = calloc(1, sizeof *rec);
+    if( !rec )
+    {
+        return NULL;
+    }
+
+    // appending keeps earlier sessions, every open starts with its own start chunk
+    rec->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if( rec->fd < 0 )
+    {
+        fprintf(stderr, "could not open recording '%s': %s\n", path, strerror(errno));
+        free(rec);
+        return NULL;
+    }
+
+    memset(&start, 0, sizeof start);
+    memcpy(start.magic, VNC_REC_MAGIC, sizeof start.magic);
+    start.version = VNC_REC_VERSION;
+    if( uuid )
+    {
+        strncpy(start.uuid, uuid, sizeof start.uuid - 1);
+    }
+
+    hdr.type = VNC_REC_START;
+    hdr.len = sizeof start;
+    hdr.time = record_wall_ns();
+    memcpy(head, &hdr, sizeof hdr);
+    memcpy(head + sizeof hdr, &start, sizeof start);
+
+    rec->cur = record_buf_new();
+    if( !rec->cur || !record_write(rec->fd, head, sizeof head) )
+    {
+        fprintf(stderr, "could not start recording '%s'.\n", path);
+        if( rec->cur )
+        {
+            free(rec->cur->data);
+            free(rec->cur);
+        }
+        close(rec->fd);
+        free(rec);
+        return NULL;
+    }
+
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+    rec->keyframe_ms = keyframe_ms ? keyframe_ms : VNC_REC_KEYFRAME_MS;
+    rec->need_keyframe = 1;
+    rec->last_handover = vnc_time_ns();
+
+    if( pthread_create(&rec->thread, NULL, record_thread, rec) )
+    {
+        fprintf(stderr, "could not start the recording thread.\n");
+        pthread_mutex_destroy(&rec->lock);
+        pthread_cond_destroy(&rec->cond);
+        free(rec->cur->data);
+        free(rec->cur);
+        close(rec->fd);
+        free(rec);
+        return NULL;
+    }
+
+    return rec;
+}
+
+// how far the writer is behind, safe to call from any thread
+void vnc_record_usage(vnc_record_t *rec, uint64_t *queued, uint64_t *dropped)
+{
+    pthread_mutex_lock(&rec->lock);
+    *queued = rec->queued;
+    pthread_mutex_unlock(&rec->lock);
+    *dropped = __atomic_load_n(&rec->dropped, __ATOMIC_RELAXED);
+}
+
+// writes out everything still buffered and stops the writer
+void vnc_record_close(vnc_record_t *rec)
+{
+    if( !rec )
+    {
+        return;
+    }
+
+    rec->open = 0;
+    record_handover(rec);
+
+    pthread_mutex_lock(&rec->lock);
+    rec->stop = 1;
+    pthread_cond_signal(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+    pthread_join(rec->thread, NULL);
+
+    if( rec->dropped )
+    {
+        fprintf(stderr, "recording dropped %lu bytes.\n", (unsigned long)rec->dropped);
+    }
+
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->cond);
+    if( rec->cur )
+    {
+        free(rec->cur->data);
+        free(rec->cur);
+    }
+    close(rec->fd);
+    free(rec);
+}
+
+// called before each message is read, starts its data chunk
+void vnc_record_begin(vnc_t *vnc)
+{
+    vnc_record_t *rec = vnc->record;
+    uint64_t now = vnc_time_ns();
+
+    if( rec->need_keyframe || now - rec->last_keyframe >= rec->keyframe_ms * 1000000ULL )
+    {
+        record_keyframe(rec, vnc);
+    }
+
+    if( !record_chunk(rec, VNC_REC_DATA, 0) )
+    {
+        rec->open = 0;
+        return;
+    }
+
+    rec->chunk = rec->cur->len - sizeof(vnc_rec_chunk_t);
+    rec->open = 1;
+}
+
+// the socket read everything in one piece, so this only ever appends
+void vnc_record_data(vnc_record_t *rec, const void *data, size_t len)
+{
+    if( !rec->open )
+    {
+        return;
+    }
+
+    if( unlikely(!record_reserve(rec->cur, len)) )
+    {
+        rec->cur->len = rec->chunk;
+        rec->open = 0;
+        rec->need_keyframe = 1;
+        return;
+    }
+
+    memcpy(rec->cur->data + rec->cur->len, data, len);
+    rec->cur->len += len;
+}
+
+// called after each message, a message that failed to decode is left out
+void vnc_record_end(vnc_t *vnc, int ok)
+{
+    vnc_record_t *rec = vnc->record;
+    vnc_rec_chunk_t *hdr;
+
+    if( !rec->open )
+    {
+        return;
+    }
+    rec->open = 0;
+
+    if( !ok )
+    {
+        rec->cur->len = rec->chunk;
+        return;
+    }
+
+    hdr = (vnc_rec_chunk_t *)(rec->cur->data + rec->chunk);
+    hdr->len = (uint32_t)(rec->cur->len - rec->chunk - sizeof *hdr);
+
+    // hand over in large pieces, but don't sit on a quiet display's data for long
+    if( rec->cur->len >= VNC_REC_BUF_SIZE || vnc_time_ns() - rec->last_handover >= VNC_REC_FLUSH_MS * 1000000ULL )
+    {
+        record_handover(rec);
+    }
+}
+
+// hands a quiet display's partial buffer to the writer once it has waited VNC_REC_FLUSH_MS
+// called between messages, returns ns until it needs to run again, 0 if nothing is waiting
+uint64_t vnc_record_flush(vnc_t *vnc)
+{
+    vnc_record_t *rec = vnc->record;
+    uint64_t flush = VNC_REC_FLUSH_MS * 1000000ULL;
+    uint64_t now = vnc_time_ns();
+
+    if( rec->open || !rec->cur || !rec->cur->len )
+    {
+        return 0;
+    }
+
+    if( now - rec->last_handover >= flush )
+    {
+        record_handover(rec);
+        return 0;
+    }
+
+    return rec->last_handover + flush - now;
+}
+
+// marks the end of a connection, the next one starts with a keyframe
+void vnc_record_disconnect(vnc_t *vnc)
+{
+    vnc_record_t *rec = vnc->record;
+
+    rec->open = 0;
+    record_chunk(rec, VNC_REC_END, 0);
+    record_handover(rec);
+    rec->need_keyframe = 1;
+}
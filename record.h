@@ -0,0 +1,69 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// on disk format of session recordings
+// a recording is a sequence of chunks, each a vnc_rec_chunk_t followed by len bytes of payload
+// every connection starts with a keyframe, so playback can begin at any keyframe
+// and decode the data chunks after it through rfb_replay
+// a keyframe is followed by a data chunk holding the cursor, unless the server draws it
+// integers are in host byte order, recordings are meant to be read on the host that made them
+
+#define VNC_REC_MAGIC "VNCREC\0\0"
+#define VNC_REC_VERSION 1
+
+typedef enum
+{
+    VNC_REC_START = 1,           // vnc_rec_start_t, written each time the file is opened
+    VNC_REC_DATA,                // server to client bytes holding one complete message
+    VNC_REC_KEYFRAME,            // vnc_rec_keyframe_t, its screens, then the framebuffer with rows packed
+    VNC_REC_END,                 // the connection was lost, no payload
+}
+vnc_rec_type_t;
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t len;                // payload bytes following this header
+    uint64_t time;               // wall clock time in ns
+}
+vnc_rec_chunk_t;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    char uuid[64];               // display the recording belongs to
+}
+vnc_rec_start_t;
+
+typedef struct
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixelsize;
+    uint32_t num_screens;        // vnc_rec_screen_t following, 0 for a single screen (older recordings)
+}
+vnc_rec_keyframe_t;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+}
+vnc_rec_screen_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,325 @@
+#include "vnc.h"
+#include "record.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// playback of session recordings
+// the file is mapped and indexed by keyframe as far as playback has needed so far, a seek
+// then decodes forward from the closest keyframe before the target instead of from the start
+
+typedef struct
+{
+    uint64_t time;
+    size_t offset;
+}
+replay_index_t;
+
+struct vnc_replay
+{
+    const uint8_t *map;
+    size_t map_len;
+    size_t pos;                  // offset of the next chunk to play
+    replay_index_t *index;       // keyframes in file order, up to scan
+    unsigned int num_index;
+    unsigned int size;           // entries allocated for index
+    size_t scan;                 // offset of the first chunk not indexed yet
+    int scanned;                 // the index covers the whole file
+    uint64_t first;              // time of the first chunk, and the last one indexed
+    uint64_t last;
+};
+
+static int replay_index_add(vnc_replay_t *r, uint64_t time, size_t offset)
+{
+    replay_index_t *index;
+    unsigned int size;
+
+    if( r->num_index == r->size )
+    {
+        size = r->size ? r->size * 2 : 256;
+        index = realloc(r->index, size * sizeof *index);
+        if( !index )
+        {
+            return 0;
+        }
+        r->index = index;
+        r->size = size;
+    }
+
+    r->index[r->num_index].time = time;
+    r->index[r->num_index].offset = offset;
+    r->num_index++;
+
+    return 1;
+}
+
+// reads the header of the chunk at pos
+// returns 0 past the end, or for a cut off chunk at the end (the recorder was killed)
+static int replay_chunk(const vnc_replay_t *r, size_t pos, vnc_rec_chunk_t *hdr)
+{
+    if( r->map_len - pos < sizeof *hdr )
+    {
+        return 0;
+    }
+    memcpy(hdr, r->map + pos, sizeof *hdr);
+    return r->map_len - pos - sizeof *hdr >= hdr->len;
+}
+
+// extends the keyframe index by walking chunk headers, until the first chunk after time
+// once there is a keyframe to start from, or to the end of the file
+static int replay_scan(vnc_replay_t *r, uint64_t time)
+{
+    vnc_rec_chunk_t hdr;
+    vnc_rec_start_t start;
+
+    while( !r->scanned )
+    {
+        if( !replay_chunk(r, r->scan, &hdr) )
+        {
+            r->scanned = 1;
+            break;
+        }
+        if( hdr.time > time && r->num_index )
+        {
+            break;
+        }
+
+        if( hdr.type == VNC_REC_START )
+        {
+            if( hdr.len < sizeof start )
+            {
+                return 0;
+            }
+            memcpy(&start, r->map + r->scan + sizeof hdr, sizeof start);
+            if( memcmp(start.magic, VNC_REC_MAGIC, sizeof start.magic) || start.version != VNC_REC_VERSION )
+            {
+                return 0;
+            }
+        }
+        else if( !r->scan )
+        {
+            return 0;
+        }
+        else if( hdr.type == VNC_REC_KEYFRAME )
+        {
+            if( !replay_index_add(r, hdr.time, r->scan) )
+            {
+                return 0;
+            }
+        }
+
+        if( !r->scan )
+        {
+            r->first = hdr.time;
+        }
+        r->last = hdr.time;
+
+        r->scan += sizeof hdr + hdr.len;
+    }
+
+    return 1;
+}
+
+vnc_replay_t *vnc_replay_open(const char *path)
+{
+    vnc_replay_t *r;
+    struct stat sb;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if( fd < 0 )
+    {
+        fprintf(stderr, "could not open recording '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if( fstat(fd, &sb) < 0 || !sb.st_size )
+    {
+        fprintf(stderr, "recording '%s' is empty.\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( map == MAP_FAILED )
+    {
+        fprintf(stderr, "could not map recording '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    r = calloc(1, sizeof *r);
+    if( !r )
+    {
+        munmap(map, (size_t)sb.st_size);
+        return NULL;
+    }
+
+    r->map = map;
+    r->map_len = (size_t)sb.st_size;
+
+    // only as far as the first keyframe, the rest is indexed as seeks reach it
+    if( !replay_scan(r, 0) || !r->num_index )
+    {
+        fprintf(stderr, "'%s' is not a usable recording.\n", path);
+        vnc_replay_close(r);
+        return NULL;
+    }
+
+    r->pos = r->index[0].offset;
+
+    return r;
+}
+
+void vnc_replay_close(vnc_replay_t *r)
+{
+    if( !r )
+    {
+        return;
+    }
+
+    munmap((void *)r->map, r->map_len);
+    free(r->index);
+    free(r);
+}
+
+// the time of the first chunk is known from opening, the last one takes a walk over the rest of the file
+void vnc_replay_span(vnc_replay_t *r, uint64_t *first, uint64_t *last)
+{
+    if( last )
+    {
+        replay_scan(r, UINT64_MAX);
+        *last = r->last;
+    }
+    *first = r->first;
+}
+
+// plays the next chunk into vnc
+// returns 0 at the end of the recording or if a chunk is damaged, otherwise 1 and its time
+int vnc_replay_step(vnc_replay_t *r, vnc_t *vnc, uint64_t *time)
+{
+    vnc_screen_t screens[VNC_MAX_SCREENS];
+    vnc_rec_keyframe_t kf;
+    vnc_rec_screen_t scr;
+    vnc_rec_chunk_t hdr;
+    const uint8_t *payload;
+    unsigned int i;
+
+    if( !replay_chunk(r, r->pos, &hdr) )
+    {
+        return 0;
+    }
+
+    payload = r->map + r->pos + sizeof hdr;
+    r->pos += sizeof hdr + hdr.len;
+
+    switch( hdr.type )
+    {
+        case VNC_REC_DATA:
+            if( unlikely(!rfb_replay(vnc, payload, hdr.len)) )
+            {
+                return 0;
+            }
+            break;
+        case VNC_REC_KEYFRAME:
+            // data chunks have any length, so nothing after one is aligned
+            if( hdr.len < sizeof kf )
+            {
+                return 0;
+            }
+            memcpy(&kf, payload, sizeof kf);
+            if( kf.num_screens > VNC_MAX_SCREENS ||
+                (uint64_t)kf.width * kf.height * kf.pixelsize + kf.num_screens * sizeof scr != hdr.len - sizeof kf ||
+                !vnc_load_frame(vnc, kf.width, kf.height, kf.pixelsize, payload + sizeof kf + kf.num_screens * sizeof scr) )
+            {
+                return 0;
+            }
+            for( i = 0; i < kf.num_screens; i++ )
+            {
+                memcpy(&scr, payload + sizeof kf + i * sizeof scr, sizeof scr);
+                screens[i].id = scr.id;
+                screens[i].rect.x = scr.x;
+                screens[i].rect.y = scr.y;
+                screens[i].rect.w = scr.width;
+                screens[i].rect.h = scr.height;
+            }
+            vnc_set_screens(vnc, screens, kf.num_screens);
+            break;
+        case VNC_REC_END:
+            vnc_vm_off(vnc);
+            break;
+        default:
+            break;
+    }
+
+    if( time )
+    {
+        *time = hdr.time;
+    }
+
+    return 1;
+}
+
+// shows the screen as it was at time, in wall clock ns
+// binary searches the keyframes, then decodes forward from the last one at or before time
+int vnc_replay_seek(vnc_replay_t *r, vnc_t *vnc, uint64_t time)
+{
+    unsigned int lo = 0, hi;
+    vnc_rec_chunk_t hdr;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t from;
+
+    // every keyframe at or before time has to be in the index
+    if( !replay_scan(r, time) )
+    {
+        return 0;
+    }
+
+    hi = r->num_index;
+    while( hi - lo > 1 )
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if( r->index[mid].time <= time )
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    // the mapping gets no advice as a whole since seeks jump around in it
+    // the keyframe is read in one go though
+    r->pos = r->index[lo].offset;
+    if( replay_chunk(r, r->pos, &hdr) && page > 0 )
+    {
+        from = r->pos & ~((size_t)page - 1);
+        madvise((void *)(r->map + from), r->pos - from + sizeof hdr + hdr.len, MADV_WILLNEED);
+    }
+    if( !vnc_replay_step(r, vnc, NULL) )
+    {
+        return 0;
+    }
+
+    while( replay_chunk(r, r->pos, &hdr) )
+    {
+        if( hdr.time > time )
+        {
+            break;
+        }
+        if( !vnc_replay_step(r, vnc, NULL) )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
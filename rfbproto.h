@@ -393,6 +393,8 @@ typedef struct {
 /* Modif sf@2002 */
 #define rfbResizeFrameBuffer 4
 #define rfbPalmVNCReSizeFrameBuffer 0xF
+/* ContinuousUpdates extension */
+#define rfbEndOfContinuousUpdates 150
 
 /* client -> server */
 
@@ -418,6 +420,10 @@ typedef struct {
 #define rfbPalmVNCSetScaleFactor 0xF
 /* Xvp message - bidirectional */
 #define rfbXvp 250
+/* ContinuousUpdates extension */
+#define rfbEnableContinuousUpdates 150
+/* Fence extension - bidirectional */
+#define rfbFence 248
 
 
 
@@ -458,6 +464,13 @@ typedef struct {
 /* Xvp pseudo-encoding */
 #define rfbEncodingXvp 			 0xFFFFFECB
 
+/* Flow control pseudo-encodings */
+#define rfbEncodingContinuousUpdates     0xFFFFFEC7 /* -313 */
+#define rfbEncodingFence                 0xFFFFFEC8 /* -312 */
+
+/* Screen layout pseudo-encoding */
+#define rfbEncodingExtDesktopSize        0xFFFFFECC /* -308 */
+
 /*
  * Special encoding numbers:
  *   0xFFFFFD00 .. 0xFFFFFD05 -- subsampling level
@@ -1147,6 +1160,84 @@ typedef struct {
 #define rfbXvp_Reset 4
 
 
+/*-----------------------------------------------------------------------------
+ * EnableContinuousUpdates - client -> server
+ * A server which supports the ContinuousUpdates extension declares this by
+ * sending an EndOfContinuousUpdates message (just the type byte) when it
+ * receives a request from the client to use the pseudo-encoding.  Once
+ * enabled, the server sends updates for the given area without waiting for
+ * FramebufferUpdateRequests.  Disabling makes the server finish with another
+ * EndOfContinuousUpdates message.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbEnableContinuousUpdates */
+    uint8_t enable;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} rfbEnableContinuousUpdatesMsg;
+
+#define sz_rfbEnableContinuousUpdatesMsg 10
+
+
+/*-----------------------------------------------------------------------------
+ * Fence - bidirectional
+ * A server which supports the Fence extension declares this by sending a
+ * fence request when it receives a request from the client to use the
+ * pseudo-encoding.  A fence with the Request flag set must be answered with
+ * the same payload, the Request flag cleared, and only the flags understood.
+ * The answer is only sent once everything before the fence was processed,
+ * which lets the sender measure how far behind the receiver is.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbFence */
+    uint8_t pad[3];
+    uint32_t flags;
+    uint8_t length;		/* payload length, at most 64 */
+    /* followed by length bytes of payload */
+} rfbFenceMsg;
+
+#define sz_rfbFenceMsg 9
+
+#define rfbFenceFlagBlockBefore 0x00000001
+#define rfbFenceFlagBlockAfter  0x00000002
+#define rfbFenceFlagSyncNext    0x00000004
+#define rfbFenceFlagRequest     0x80000000
+#define rfbFenceFlagsSupported  (rfbFenceFlagBlockBefore | rfbFenceFlagBlockAfter | rfbFenceFlagSyncNext)
+#define rfbFenceMaxPayload 64
+
+
+/*-----------------------------------------------------------------------------
+ * ExtendedDesktopSize - sent as a rectangle of a framebuffer update.
+ * x holds the reason for the change (0 the server, 1 this client, 2 another
+ * client), y a status code (0 for success), w and h the new framebuffer size.
+ * The rectangle is followed by the screen layout: an rfbExtDesktopSizeMsg and
+ * numberOfScreens rfbExtDesktopScreen, in the framebuffer's coordinates.
+ */
+
+typedef struct {
+    uint8_t numberOfScreens;
+    uint8_t pad[3];
+    /* followed by numberOfScreens * rfbExtDesktopScreen */
+} rfbExtDesktopSizeMsg;
+
+#define sz_rfbExtDesktopSizeMsg 4
+
+typedef struct {
+    uint32_t id;
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    uint32_t flags;
+} rfbExtDesktopScreen;
+
+#define sz_rfbExtDesktopScreen 16
+
+
 /*-----------------------------------------------------------------------------
  * Modif sf@2002
  * ResizeFrameBuffer - The Client must change the size of its framebuffer  
@@ -1201,6 +1292,7 @@ typedef union {
 	rfbFileTransferMsg ft;
 	rfbTextChatMsg tc;
         rfbXvpMsg xvp;
+    rfbFenceMsg f;
 } rfbServerToClientMsg;
 
 
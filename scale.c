@@ -0,0 +1,420 @@
+#include "vnc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// downscaled frames for displays with cfg.scale set
+// the server is asked to scale with rfbSetScale when connecting, if it doesn't the
+// framebuffer arrives at full size and each view box filters the damaged parts into a
+// scaled copy, so consumers see the same small frames either way
+//
+// the mip levels are a chain of 2x2 box filtered halves of the shown frame, kept up to
+// date from damage so a thumbnail costs a quarter of the changed pixels per level
+// power of two scales are served from them, other factors use the plain box filter
+
+// scaled length, a partly covered block still makes a pixel
+static inline unsigned int scale_len(unsigned int len, unsigned int f)
+{
+    return (len + f - 1) / f;
+}
+
+// the scaled pixels a framebuffer rectangle touches
+static void scale_rect(const vnc_rect_t *in, vnc_rect_t *out, unsigned int f)
+{
+    out->x = in->x / f;
+    out->y = in->y / f;
+    out->w = scale_len(in->x + in->w, f) - out->x;
+    out->h = scale_len(in->y + in->h, f) - out->y;
+}
+
+// averages every f x f block behind r, a scaled rectangle, into the scaled copy
+// only 32 bit pixels are averaged, smaller ones pack channels across bytes and are point sampled
+static void scale_box(vnc_t *vnc, const vnc_rect_t *r, unsigned int f)
+{
+    const uint8_t *fb = vnc_framebuffer(vnc);
+    unsigned int ps = vnc->server.pixelsize;
+    unsigned int x, y, sx, sy, x0, y0, x1, y1, n;
+    uint32_t sum[4];
+    const uint8_t *src;
+    uint8_t *dst;
+
+    for( y = r->y; y < r->y + r->h; y++ )
+    {
+        y0 = y * f;
+        y1 = y0 + f < vnc->server.height ? y0 + f : vnc->server.height;
+        dst = vnc->scale.pixels + y * vnc->scale.stride + r->x * ps;
+
+        for( x = r->x; x < r->x + r->w; x++ )
+        {
+            x0 = x * f;
+            x1 = x0 + f < vnc->server.width ? x0 + f : vnc->server.width;
+
+            if( ps != 4 )
+            {
+                memcpy(dst, fb + y0 * vnc->server.stride + x0 * ps, ps);
+                dst += ps;
+                continue;
+            }
+
+            sum[0] = sum[1] = sum[2] = sum[3] = 0;
+            for( sy = y0; sy < y1; sy++ )
+            {
+                src = fb + sy * vnc->server.stride + x0 * 4;
+                for( sx = x0; sx < x1; sx++ )
+                {
+                    sum[0] += src[0];
+                    sum[1] += src[1];
+                    sum[2] += src[2];
+                    sum[3] += src[3];
+                    src += 4;
+                }
+            }
+
+            n = (x1 - x0) * (y1 - y0);
+            dst[0] = (uint8_t)((sum[0] + n / 2) / n);
+            dst[1] = (uint8_t)((sum[1] + n / 2) / n);
+            dst[2] = (uint8_t)((sum[2] + n / 2) / n);
+            dst[3] = (uint8_t)((sum[3] + n / 2) / n);
+            dst += 4;
+        }
+    }
+}
+
+// copies a rectangle of scaled pixels that are already done into the scaled copy
+// that is the framebuffer when the server scaled, or a mip level
+static void scale_copy(vnc_t *vnc, const uint8_t *pixels, unsigned int stride, const vnc_rect_t *r)
+{
+    unsigned int ps = vnc->server.pixelsize;
+    const uint8_t *src = pixels + r->y * stride + r->x * ps;
+    uint8_t *dst = vnc->scale.pixels + r->y * vnc->scale.stride + r->x * ps;
+    unsigned int y;
+
+    for( y = 0; y < r->h; y++ )
+    {
+        memcpy(dst, src, (size_t)r->w * ps);
+        src += stride;
+        dst += vnc->scale.stride;
+    }
+}
+
+// averages four 32 bit pixels, rounding to nearest
+static inline void half_pixel(const uint8_t *a, const uint8_t *b, const uint8_t *c, const uint8_t *d, uint8_t *out)
+{
+    out[0] = (uint8_t)((a[0] + b[0] + c[0] + d[0] + 2) >> 2);
+    out[1] = (uint8_t)((a[1] + b[1] + c[1] + d[1] + 2) >> 2);
+    out[2] = (uint8_t)((a[2] + b[2] + c[2] + d[2] + 2) >> 2);
+    out[3] = (uint8_t)((a[3] + b[3] + c[3] + d[3] + 2) >> 2);
+}
+
+// halves output pixels x up to x1 of one row from source rows s0 and s1, four at a time
+// returns where it stopped, the rest is left to half_pixel
+static unsigned int half_row(const uint8_t *s0, const uint8_t *s1, uint8_t *dst, unsigned int x, unsigned int x1)
+{
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    __m128i a, b, lo, hi, p, q;
+
+    for( ; x + 4 <= x1; x += 4 )
+    {
+        // widen to 16 bits and add the rows, each lane pair then holds two source columns
+        a = _mm_loadu_si128((const __m128i *)(s0 + x * 8));
+        b = _mm_loadu_si128((const __m128i *)(s1 + x * 8));
+        lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+        hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+        p = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+
+        a = _mm_loadu_si128((const __m128i *)(s0 + x * 8 + 16));
+        b = _mm_loadu_si128((const __m128i *)(s1 + x * 8 + 16));
+        lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+        hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+        q = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+
+        p = _mm_srli_epi16(_mm_add_epi16(p, two), 2);
+        q = _mm_srli_epi16(_mm_add_epi16(q, two), 2);
+        _mm_storeu_si128((__m128i *)(dst + x * 4), _mm_packus_epi16(p, q));
+    }
+#else
+    (void)s0;
+    (void)s1;
+    (void)dst;
+    (void)x1;
+#endif
+    return x;
+}
+
+// fills r of dst, in dst's pixels, from the frame twice its size
+// a last odd row or column is averaged with itself, which is the mean of what exists
+static void scale_half(const uint8_t *src, unsigned int stride, unsigned int width, unsigned int height,
+                       unsigned int ps, vnc_mip_level_t *dst, const vnc_rect_t *r)
+{
+    unsigned int x, y, x1, edge;
+    const uint8_t *s0, *s1;
+    uint8_t *out;
+
+    for( y = r->y; y < r->y + r->h; y++ )
+    {
+        s0 = src + 2 * y * stride;
+        s1 = 2 * y + 1 < height ? s0 + stride : s0;
+        out = dst->pixels + y * dst->stride;
+        x1 = r->x + r->w;
+
+        // packed pixels smaller than 32 bits are point sampled
+        if( ps != 4 )
+        {
+            for( x = r->x; x < x1; x++ )
+            {
+                memcpy(out + x * ps, s0 + 2 * x * ps, ps);
+            }
+            continue;
+        }
+
+        edge = 2 * x1 > width;
+        x1 -= edge;
+
+        x = half_row(s0, s1, out, r->x, x1);
+        for( ; x < x1; x++ )
+        {
+            half_pixel(s0 + x * 8, s0 + x * 8 + 4, s1 + x * 8, s1 + x * 8 + 4, out + x * 4);
+        }
+        if( edge )
+        {
+            half_pixel(s0 + x * 8, s0 + x * 8, s1 + x * 8, s1 + x * 8, out + x * 4);
+        }
+    }
+}
+
+// brings mip levels 1 to level up to date with the shown frame and returns the last
+// call on every update before clearing status.updated, like vnc_view, levels that
+// were skipped for an update would keep what it changed out
+// level 1 is half size, 2 a quarter and 3 an eighth, NULL if there is no frame or memory
+const vnc_mip_level_t *vnc_mip(vnc_t *vnc, unsigned int level)
+{
+    vnc_mip_t *mip = &vnc->mip;
+    unsigned int ps = vnc->server.pixelsize;
+    const uint8_t *src = vnc_pixels(vnc);
+    unsigned int width = vnc->server.width;
+    unsigned int height = vnc->server.height;
+    unsigned int stride = vnc->server.stride;
+    unsigned int n, i, count;
+    vnc_mip_level_t *l;
+    vnc_rect_t all, r;
+    uint8_t *pixels;
+    size_t size;
+
+    if( !level || level > VNC_MIP_LEVELS || !width || !height )
+    {
+        return NULL;
+    }
+
+    // a new size, format or the off screen replaces every pixel
+    if( width != mip->width || height != mip->height || ps != mip->pixelsize || vnc->status.off != mip->off )
+    {
+        mip->levels = 0;
+        mip->width = width;
+        mip->height = height;
+        mip->pixelsize = ps;
+        mip->off = vnc->status.off;
+    }
+
+    count = level > mip->levels ? level : mip->levels;
+    for( n = 0; n < count; n++ )
+    {
+        l = &mip->level[n];
+
+        if( n >= mip->levels )
+        {
+            l->width = scale_len(width, 2);
+            l->height = scale_len(height, 2);
+            l->stride = l->width * ps;
+            size = (size_t)l->stride * l->height;
+            if( size > l->size )
+            {
+                pixels = realloc(l->pixels, size);
+                if( !pixels )
+                {
+                    mip->levels = n;
+                    return NULL;
+                }
+                l->pixels = pixels;
+                l->size = size;
+            }
+
+            all.x = 0;
+            all.y = 0;
+            all.w = l->width;
+            all.h = l->height;
+            scale_half(src, stride, width, height, ps, l, &all);
+        }
+        else
+        {
+            // damage rounded out to whole blocks of this level
+            for( i = 0; i < vnc->status.num_damage; i++ )
+            {
+                scale_rect(&vnc->status.damage[i], &r, 2u << n);
+                scale_half(src, stride, width, height, ps, l, &r);
+            }
+        }
+
+        src = l->pixels;
+        stride = l->stride;
+        width = l->width;
+        height = l->height;
+    }
+
+    mip->levels = count;
+    return &mip->level[level - 1];
+}
+
+// the mip level matching a scale, 0 if it isn't a power of two there is a level for
+static unsigned int scale_mip_level(unsigned int f)
+{
+    unsigned int n;
+
+    for( n = 1; n <= VNC_MIP_LEVELS; n++ )
+    {
+        if( f == 1u << n )
+        {
+            return n;
+        }
+    }
+    return 0;
+}
+
+static void view_unscaled(vnc_t *vnc, vnc_view_t *view)
+{
+    view->pixels = vnc_pixels(vnc);
+    view->width = vnc->server.width;
+    view->height = vnc->server.height;
+    view->stride = vnc->server.stride;
+    view->pixelsize = vnc->server.pixelsize;
+    view->num_damage = vnc->status.num_damage;
+    view->damage = vnc->status.damage;
+    view->num_screens = vnc->status.num_screens;
+    view->screens = vnc->status.screens;
+}
+
+// fills view with the frame consumers should get, scaling what changed since the last call
+// call from the thread running the display, before clearing status.updated
+void vnc_view(vnc_t *vnc, vnc_view_t *view)
+{
+    vnc_scale_t *sc = &vnc->scale;
+    unsigned int ps = vnc->server.pixelsize;
+    const vnc_mip_level_t *mip = NULL;
+    unsigned int f, i, level;
+    size_t size;
+    uint8_t *pixels;
+
+    if( vnc->cfg.scale < 2 || vnc->status.off )
+    {
+        view_unscaled(vnc, view);
+        return;
+    }
+
+    // the first update shows whether the server took the scale, a server that did has shrunk the frame
+    if( !sc->client && vnc->first_frame_time )
+    {
+        sc->client = vnc->server.width < sc->orig_width ? 1 : vnc->cfg.scale;
+        if( sc->client > 1 )
+        {
+            vnc_log(vnc, VNC_LOG_INFO, "server sends full size frames, scaling by 1/%u here.", sc->client);
+        }
+    }
+    f = sc->client ? sc->client : vnc->cfg.scale;
+
+    // nothing left to do, and no user buffer to copy into
+    if( f == 1 && !vnc->cfg.use_buffer )
+    {
+        view_unscaled(vnc, view);
+        return;
+    }
+
+    level = scale_mip_level(f);
+    if( level )
+    {
+        mip = vnc_mip(vnc, level);
+    }
+
+    sc->width = scale_len(vnc->server.width, f);
+    sc->height = scale_len(vnc->server.height, f);
+    sc->stride = sc->width * ps;
+    size = (size_t)sc->stride * sc->height;
+
+    // without a user buffer a mip level is the view itself, nothing to copy
+    if( vnc->cfg.use_buffer )
+    {
+        sc->pixels = vnc->cfg.buffer;
+    }
+    else if( !mip && size > sc->size )
+    {
+        pixels = realloc(sc->pixels, size);
+        if( !pixels )
+        {
+            view_unscaled(vnc, view);
+            return;
+        }
+        sc->pixels = pixels;
+        sc->size = size;
+    }
+
+    sc->num_damage = vnc->status.num_damage;
+    for( i = 0; i < sc->num_damage; i++ )
+    {
+        if( f == 1 )
+        {
+            sc->damage[i] = vnc->status.damage[i];
+            scale_copy(vnc, vnc_framebuffer(vnc), vnc->server.stride, &sc->damage[i]);
+            continue;
+        }
+
+        scale_rect(&vnc->status.damage[i], &sc->damage[i], f);
+        if( !mip )
+        {
+            scale_box(vnc, &sc->damage[i], f);
+        }
+        else if( vnc->cfg.use_buffer )
+        {
+            scale_copy(vnc, mip->pixels, mip->stride, &sc->damage[i]);
+        }
+    }
+
+    for( i = 0; i < vnc->status.num_screens; i++ )
+    {
+        sc->screens[i].id = vnc->status.screens[i].id;
+        scale_rect(&vnc->status.screens[i].rect, &sc->screens[i].rect, f);
+    }
+
+    view->pixels = mip && !vnc->cfg.use_buffer ? mip->pixels : sc->pixels;
+    view->width = sc->width;
+    view->height = sc->height;
+    view->stride = sc->stride;
+    view->pixelsize = ps;
+    view->num_damage = sc->num_damage;
+    view->damage = sc->damage;
+    view->num_screens = vnc->status.num_screens;
+    view->screens = sc->screens;
+}
+
+void vnc_scale_free(vnc_t *vnc)
+{
+    unsigned int n;
+
+    if( !vnc->cfg.use_buffer )
+    {
+        free(vnc->scale.pixels);
+    }
+    vnc->scale.pixels = NULL;
+    vnc->scale.size = 0;
+
+    for( n = 0; n < VNC_MIP_LEVELS; n++ )
+    {
+        free(vnc->mip.level[n].pixels);
+        vnc->mip.level[n].pixels = NULL;
+        vnc->mip.level[n].size = 0;
+    }
+    vnc->mip.levels = 0;
+}
@@ -0,0 +1,179 @@
+#include "vnc.h"
+
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// limits how many displays can be in the handshake at once
+// displays with consumers attached are let through before idle ones
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int max;            // 0 means unlimited
+    unsigned int active;
+    unsigned int priority_waiting;
+}
+sched = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+
+// shares a total update rate between every connected display
+static struct
+{
+    unsigned int budget;         // total updates per second, 0 means unlimited
+    unsigned int connected;
+}
+governor = { 0, 0 };
+
+void vnc_sleep_ms(unsigned int ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while( nanosleep(&ts, &ts) == -1 && errno == EINTR );
+}
+
+void vnc_sched_init(unsigned int max_handshakes)
+{
+    pthread_mutex_lock(&sched.lock);
+    sched.max = max_handshakes;
+    pthread_cond_broadcast(&sched.cond);
+    pthread_mutex_unlock(&sched.lock);
+}
+
+void vnc_sched_acquire(vnc_t *vnc)
+{
+    int priority = vnc_consumers(vnc) > 0;
+
+    pthread_mutex_lock(&sched.lock);
+    if( priority )
+    {
+        sched.priority_waiting++;
+    }
+    while( sched.max && (sched.active >= sched.max || (!priority && sched.priority_waiting)) )
+    {
+        pthread_cond_wait(&sched.cond, &sched.lock);
+    }
+    if( priority )
+    {
+        sched.priority_waiting--;
+    }
+    sched.active++;
+    pthread_mutex_unlock(&sched.lock);
+}
+
+void vnc_sched_release(vnc_t *vnc)
+{
+    (void)vnc;
+
+    pthread_mutex_lock(&sched.lock);
+    sched.active--;
+    pthread_cond_broadcast(&sched.cond);
+    pthread_mutex_unlock(&sched.lock);
+}
+
+unsigned int vnc_sched_active(void)
+{
+    unsigned int active;
+
+    pthread_mutex_lock(&sched.lock);
+    active = sched.active;
+    pthread_mutex_unlock(&sched.lock);
+
+    return active;
+}
+
+// exponential backoff with jitter, so displays that failed together don't retry together
+// returns how many ms to wait before the next attempt
+unsigned int vnc_backoff_next(vnc_t *vnc)
+{
+    unsigned int base = VNC_BACKOFF_MAX_MS;
+
+    if( unlikely(!vnc->seed) )
+    {
+        vnc->seed = (unsigned int)(vnc_time_ns() ^ (uintptr_t)vnc) | 1;
+    }
+
+    if( vnc->attempts < 16 && (VNC_BACKOFF_MIN_MS << vnc->attempts) < VNC_BACKOFF_MAX_MS )
+    {
+        base = VNC_BACKOFF_MIN_MS << vnc->attempts;
+    }
+    vnc->attempts++;
+
+    return base / 2 + (unsigned int)rand_r(&vnc->seed) % (base / 2 + 1);
+}
+
+void vnc_backoff_reset(vnc_t *vnc)
+{
+    vnc->attempts = 0;
+}
+
+void vnc_attach(vnc_t *vnc)
+{
+    __atomic_add_fetch(&vnc->consumers, 1, __ATOMIC_RELAXED);
+}
+
+void vnc_detach(vnc_t *vnc)
+{
+    __atomic_sub_fetch(&vnc->consumers, 1, __ATOMIC_RELAXED);
+}
+
+int vnc_consumers(vnc_t *vnc)
+{
+    return __atomic_load_n(&vnc->consumers, __ATOMIC_RELAXED);
+}
+
+void vnc_governor_budget(unsigned int total_fps)
+{
+    __atomic_store_n(&governor.budget, total_fps, __ATOMIC_RELAXED);
+}
+
+void vnc_governor_join(vnc_t *vnc)
+{
+    if( !vnc->governed )
+    {
+        vnc->governed = 1;
+        __atomic_add_fetch(&governor.connected, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void vnc_governor_leave(vnc_t *vnc)
+{
+    if( vnc->governed )
+    {
+        vnc->governed = 0;
+        __atomic_sub_fetch(&governor.connected, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// how long to leave between update requests, 0 if they can go out as fast as possible
+// the display's own rate applies, dropping to the idle rate while nobody is attached,
+// and no display may take more than its even share of the global budget
+uint64_t vnc_request_interval(vnc_t *vnc)
+{
+    unsigned int budget = __atomic_load_n(&governor.budget, __ATOMIC_RELAXED);
+    unsigned int connected = __atomic_load_n(&governor.connected, __ATOMIC_RELAXED);
+    unsigned int fps = vnc->cfg.fps;
+    unsigned int share;
+
+    if( vnc->cfg.idle_fps && !vnc_consumers(vnc) )
+    {
+        fps = vnc->cfg.idle_fps;
+    }
+
+    if( budget && connected )
+    {
+        share = budget / connected;
+        if( !share )
+        {
+            share = 1;
+        }
+        if( !fps || share < fps )
+        {
+            fps = share;
+        }
+    }
+
+    return fps ? 1000000000ULL / fps : 0;
+}
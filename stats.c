@@ -0,0 +1,399 @@
+#include "vnc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+// per display counters and latency histograms
+
+static unsigned int hist_index(uint64_t value)
+{
+    unsigned int msb;
+
+    if( value < VNC_HIST_SUB )
+    {
+        return (unsigned int)value;
+    }
+
+    msb = 63 - (unsigned int)__builtin_clzll(value);
+    return (msb - VNC_HIST_SUB_BITS + 1) * VNC_HIST_SUB + (unsigned int)((value >> (msb - VNC_HIST_SUB_BITS)) & (VNC_HIST_SUB - 1));
+}
+
+// highest value that lands in a bucket
+static uint64_t hist_value(unsigned int index)
+{
+    unsigned int shift;
+
+    if( index < VNC_HIST_SUB )
+    {
+        return index;
+    }
+
+    shift = index / VNC_HIST_SUB - 1;
+    return ((uint64_t)(VNC_HIST_SUB + index % VNC_HIST_SUB) << shift) + ((1ULL << shift) - 1);
+}
+
+void vnc_hist_add(vnc_hist_t *h, uint64_t value)
+{
+    vnc_count(&h->buckets[hist_index(value)], 1);
+    vnc_count(&h->count, 1);
+    vnc_count(&h->sum, value);
+    if( value > h->max )
+    {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+// percentile between 0 and 100, accurate to the bucket it falls in
+uint64_t vnc_hist_percentile(const vnc_hist_t *h, double percentile)
+{
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    uint64_t target, seen = 0;
+    unsigned int i;
+
+    if( !count )
+    {
+        return 0;
+    }
+
+    target = (uint64_t)(count * percentile / 100.0 + 0.5);
+    if( !target )
+    {
+        target = 1;
+    }
+
+    for( i = 0; i < VNC_HIST_BUCKETS; i++ )
+    {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if( seen >= target )
+        {
+            return hist_value(i) < max ? hist_value(i) : max;
+        }
+    }
+
+    return max;
+}
+
+// an update request went out
+void vnc_stats_request(vnc_t *vnc)
+{
+    vnc_stats_t *s = &vnc->stats;
+
+    if( s->num_requests < VNC_STAT_REQUESTS )
+    {
+        s->requests[(s->first_request + s->num_requests) % VNC_STAT_REQUESTS] = vnc_time_ns();
+        s->num_requests++;
+    }
+}
+
+// an update answering the oldest request in flight arrived
+void vnc_stats_response(vnc_t *vnc, uint64_t now)
+{
+    vnc_stats_t *s = &vnc->stats;
+
+    if( s->num_requests )
+    {
+        vnc_hist_add(&s->request_latency, now - s->requests[s->first_request]);
+        s->first_request = (s->first_request + 1) % VNC_STAT_REQUESTS;
+        s->num_requests--;
+    }
+}
+
+// a consumer took the pending update
+void vnc_stats_published(vnc_t *vnc)
+{
+    vnc_stats_t *s = &vnc->stats;
+
+    vnc_count(&s->frames, 1);
+    if( s->decoded )
+    {
+        vnc_hist_add(&s->publish_latency, vnc_time_ns() - s->decoded);
+        s->decoded = 0;
+    }
+}
+
+static int hist_text(char *buf, size_t len, const char *name, const vnc_hist_t *h)
+{
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    uint64_t sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+
+    return snprintf(buf, len, "%-16s count %lu mean %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f us\n",
+                    name,
+                    (unsigned long)count,
+                    count ? sum / 1e3 / count : 0.0,
+                    vnc_hist_percentile(h, 50) / 1e3,
+                    vnc_hist_percentile(h, 90) / 1e3,
+                    vnc_hist_percentile(h, 99) / 1e3,
+                    __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e3);
+}
+
+// where the next piece of text goes, NULL once the buffer is full so only the length is counted
+static char *text_at(char *buf, size_t len, size_t n)
+{
+    return buf && n < len ? buf + n : NULL;
+}
+
+// formats every counter as text, returns the length it needed like snprintf
+int vnc_stats_text(vnc_t *vnc, char *buf, size_t len)
+{
+    vnc_stats_t *s = &vnc->stats;
+    uint64_t connects = __atomic_load_n(&s->connects, __ATOMIC_RELAXED);
+    size_t n = 0;
+    int i;
+
+#define STATS_APPEND(call) \
+    do \
+    { \
+        i = call; \
+        if( i < 0 ) \
+        { \
+            return i; \
+        } \
+        n += (size_t)i; \
+    } \
+    while( 0 )
+
+    STATS_APPEND(snprintf(text_at(buf, len, n), n < len ? len - n : 0,
+        "display          %s\n"
+        "connected        %d\n"
+        "bytes            %lu\n"
+        "updates          %lu\n"
+        "frames           %lu\n"
+        "dropped          %lu\n"
+        "pixels           %lu\n"
+        "rects            raw %lu copyrect %lu newfbsize %lu cursor %lu other %lu\n"
+        "reconnects       %lu\n"
+        "failures         %lu\n"
+        "handshake        %.1f us\n",
+        vnc->cfg.uuid ? vnc->cfg.uuid : "",
+        !vnc->status.off,
+        (unsigned long)__atomic_load_n(&s->bytes, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&s->updates, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&s->frames, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&s->dropped, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&s->pixels, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&s->rects[VNC_STAT_RAW], __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&s->rects[VNC_STAT_COPYRECT], __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&s->rects[VNC_STAT_NEWFBSIZE], __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&s->rects[VNC_STAT_CURSOR], __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&s->rects[VNC_STAT_OTHER], __ATOMIC_RELAXED),
+        (unsigned long)(connects ? connects - 1 : 0),
+        (unsigned long)__atomic_load_n(&s->failures, __ATOMIC_RELAXED),
+        vnc->handshake_time / 1e3));
+    STATS_APPEND(hist_text(text_at(buf, len, n), n < len ? len - n : 0, "request latency", &s->request_latency));
+    STATS_APPEND(hist_text(text_at(buf, len, n), n < len ? len - n : 0, "decode time", &s->decode_time));
+    STATS_APPEND(hist_text(text_at(buf, len, n), n < len ? len - n : 0, "publish latency", &s->publish_latency));
+
+#undef STATS_APPEND
+
+    return (int)n;
+}
+
+// counters exported to prometheus, all read straight out of vnc_stats_t
+static const struct
+{
+    const char *name;
+    const char *help;
+    size_t offset;
+}
+prom_counters[] =
+{
+    { "vncxfer_bytes_total", "Bytes read from the server.", offsetof(vnc_stats_t, bytes) },
+    { "vncxfer_updates_total", "Framebuffer updates decoded.", offsetof(vnc_stats_t, updates) },
+    { "vncxfer_frames_total", "Updates handed to a consumer.", offsetof(vnc_stats_t, frames) },
+    { "vncxfer_dropped_updates_total", "Updates merged because the consumer had not taken the previous one.", offsetof(vnc_stats_t, dropped) },
+    { "vncxfer_pixels_total", "Pixels written by raw and copyrect rectangles.", offsetof(vnc_stats_t, pixels) },
+    { "vncxfer_connects_total", "Successful connections.", offsetof(vnc_stats_t, connects) },
+    { "vncxfer_handshake_failures_total", "Connections that failed during the handshake.", offsetof(vnc_stats_t, failures) },
+};
+
+static const struct
+{
+    const char *name;
+    const char *help;
+    size_t offset;
+}
+prom_summaries[] =
+{
+    { "vncxfer_request_latency_seconds", "Update request sent to its update arriving.", offsetof(vnc_stats_t, request_latency) },
+    { "vncxfer_decode_seconds", "Time spent decoding one update.", offsetof(vnc_stats_t, decode_time) },
+    { "vncxfer_publish_latency_seconds", "Update decoded to taken by a consumer.", offsetof(vnc_stats_t, publish_latency) },
+};
+
+static const char *const prom_encodings[VNC_STAT_ENCODINGS] = { "raw", "copyrect", "newfbsize", "cursor", "other" };
+
+static uint64_t prom_load(vnc_t *vnc, size_t offset)
+{
+    return __atomic_load_n((uint64_t *)((uint8_t *)&vnc->stats + offset), __ATOMIC_RELAXED);
+}
+
+// a display name as a label value, with backslash, double quote and newline escaped as the text format requires
+static char *prom_label(const char *name)
+{
+    size_t len = name ? strlen(name) : 0;
+    char *label = malloc(len * 2 + 1);
+    char *dst = label;
+    size_t i;
+
+    if( !label )
+    {
+        return NULL;
+    }
+
+    for( i = 0; i < len; i++ )
+    {
+        switch( name[i] )
+        {
+            case '\\':
+                *dst++ = '\\';
+                *dst++ = '\\';
+                break;
+            case '"':
+                *dst++ = '\\';
+                *dst++ = '"';
+                break;
+            case '\n':
+                *dst++ = '\\';
+                *dst++ = 'n';
+                break;
+            default:
+                *dst++ = name[i];
+                break;
+        }
+    }
+    *dst = 0;
+
+    return label;
+}
+
+static int prom_write(FILE *out, vnc_t *const *vncs, char *const *labels, unsigned int count)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+    unsigned int i, j, k;
+    uint64_t queued, dropped;
+
+    fprintf(out, "# HELP vncxfer_handshakes_active Displays in the rfb handshake.\n"
+                 "# TYPE vncxfer_handshakes_active gauge\n"
+                 "vncxfer_handshakes_active %u\n", vnc_sched_active());
+
+    fprintf(out, "# HELP vncxfer_connected Whether the display is connected.\n"
+                 "# TYPE vncxfer_connected gauge\n");
+    for( i = 0; i < count; i++ )
+    {
+        fprintf(out, "vncxfer_connected{display=\"%s\"} %d\n", labels[i], !__atomic_load_n(&vncs[i]->status.off, __ATOMIC_RELAXED));
+    }
+
+    fprintf(out, "# HELP vncxfer_consumers Consumers attached to the display.\n"
+                 "# TYPE vncxfer_consumers gauge\n");
+    for( i = 0; i < count; i++ )
+    {
+        fprintf(out, "vncxfer_consumers{display=\"%s\"} %d\n", labels[i], vnc_consumers(vncs[i]));
+    }
+
+    fprintf(out, "# HELP vncxfer_requests_in_flight Update requests sent but not yet answered.\n"
+                 "# TYPE vncxfer_requests_in_flight gauge\n");
+    for( i = 0; i < count; i++ )
+    {
+        fprintf(out, "vncxfer_requests_in_flight{display=\"%s\"} %u\n", labels[i], __atomic_load_n(&vncs[i]->outstanding, __ATOMIC_RELAXED));
+    }
+
+    fprintf(out, "# HELP vncxfer_handshake_seconds Time the last handshake took.\n"
+                 "# TYPE vncxfer_handshake_seconds gauge\n");
+    for( i = 0; i < count; i++ )
+    {
+        fprintf(out, "vncxfer_handshake_seconds{display=\"%s\"} %.9f\n", labels[i], __atomic_load_n(&vncs[i]->handshake_time, __ATOMIC_RELAXED) / 1e9);
+    }
+
+    for( j = 0; j < sizeof prom_counters / sizeof prom_counters[0]; j++ )
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", prom_counters[j].name, prom_counters[j].help, prom_counters[j].name);
+        for( i = 0; i < count; i++ )
+        {
+            fprintf(out, "%s{display=\"%s\"} %lu\n", prom_counters[j].name, labels[i], (unsigned long)prom_load(vncs[i], prom_counters[j].offset));
+        }
+    }
+
+    fprintf(out, "# HELP vncxfer_rects_total Rectangles decoded per encoding.\n"
+                 "# TYPE vncxfer_rects_total counter\n");
+    for( i = 0; i < count; i++ )
+    {
+        for( k = 0; k < VNC_STAT_ENCODINGS; k++ )
+        {
+            fprintf(out, "vncxfer_rects_total{display=\"%s\",encoding=\"%s\"} %lu\n", labels[i], prom_encodings[k],
+                    (unsigned long)__atomic_load_n(&vncs[i]->stats.rects[k], __ATOMIC_RELAXED));
+        }
+    }
+
+    for( j = 0; j < sizeof prom_summaries / sizeof prom_summaries[0]; j++ )
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", prom_summaries[j].name, prom_summaries[j].help, prom_summaries[j].name);
+        for( i = 0; i < count; i++ )
+        {
+            const vnc_hist_t *h = (const vnc_hist_t *)((uint8_t *)&vncs[i]->stats + prom_summaries[j].offset);
+
+            for( k = 0; k < sizeof quantiles / sizeof quantiles[0]; k++ )
+            {
+                fprintf(out, "%s{display=\"%s\",quantile=\"%g\"} %.9f\n", prom_summaries[j].name, labels[i], quantiles[k],
+                        vnc_hist_percentile(h, quantiles[k] * 100) / 1e9);
+            }
+            fprintf(out, "%s_sum{display=\"%s\"} %.9f\n", prom_summaries[j].name, labels[i], __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e9);
+            fprintf(out, "%s_count{display=\"%s\"} %lu\n", prom_summaries[j].name, labels[i], (unsigned long)__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+        }
+    }
+
+    fprintf(out, "# HELP vncxfer_record_queued_bytes Recording data waiting for the disk.\n"
+                 "# TYPE vncxfer_record_queued_bytes gauge\n");
+    for( i = 0; i < count; i++ )
+    {
+        vnc_record_t *rec = __atomic_load_n(&vncs[i]->record, __ATOMIC_ACQUIRE);
+        if( rec )
+        {
+            vnc_record_usage(rec, &queued, &dropped);
+            fprintf(out, "vncxfer_record_queued_bytes{display=\"%s\"} %lu\n", labels[i], (unsigned long)queued);
+        }
+    }
+
+    fprintf(out, "# HELP vncxfer_record_dropped_bytes_total Recording data dropped because the disk fell behind.\n"
+                 "# TYPE vncxfer_record_dropped_bytes_total counter\n");
+    for( i = 0; i < count; i++ )
+    {
+        vnc_record_t *rec = __atomic_load_n(&vncs[i]->record, __ATOMIC_ACQUIRE);
+        if( rec )
+        {
+            vnc_record_usage(rec, &queued, &dropped);
+            fprintf(out, "vncxfer_record_dropped_bytes_total{display=\"%s\"} %lu\n", labels[i], (unsigned long)dropped);
+        }
+    }
+
+    return !ferror(out);
+}
+
+// writes the stats of every display in the prometheus text exposition format
+// only relaxed loads are used, so the display threads are never held up
+int vnc_stats_prometheus(FILE *out, vnc_t *const *vncs, unsigned int count)
+{
+    char **labels = calloc(count ? count : 1, sizeof *labels);
+    unsigned int i;
+    int ok = labels != NULL;
+
+    for( i = 0; ok && i < count; i++ )
+    {
+        labels[i] = prom_label(vncs[i]->cfg.uuid);
+        ok = labels[i] != NULL;
+    }
+
+    if( ok )
+    {
+        ok = prom_write(out, vncs, labels, count);
+    }
+
+    for( i = 0; labels && i < count; i++ )
+    {
+        free(labels[i]);
+    }
+    free(labels);
+
+    return ok;
+}
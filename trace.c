@@ -0,0 +1,170 @@
+#include "vnc.h"
+#include "trace.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef VNC_TRACE
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+    const char *name;            // always a string literal
+}
+trace_event_t;
+
+// written only by its own thread, the dump reads it while it keeps going
+// rings are deliberately leaked until the process exits, a display thread that gave up or was stopped
+// keeps its events in the dump, and the dump walks the list without a lock so nothing may be unlinked
+typedef struct trace_ring
+{
+    trace_event_t events[VNC_TRACE_EVENTS];
+    uint64_t head;               // events written so far
+    unsigned int tid;
+    char name[64];
+    struct trace_ring *next;
+}
+trace_ring_t;
+
+static __thread trace_ring_t *trace_local;
+
+static struct
+{
+    pthread_mutex_t lock;
+    trace_ring_t *rings;
+    unsigned int tids;
+}
+trace = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+static trace_ring_t *trace_ring(void)
+{
+    trace_ring_t *ring = trace_local;
+
+    if( likely(ring != NULL) )
+    {
+        return ring;
+    }
+
+    ring = calloc(1, sizeof *ring);
+    if( !ring )
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&trace.lock);
+    ring->tid = ++trace.tids;
+    ring->next = trace.rings;
+    __atomic_store_n(&trace.rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace.lock);
+
+    trace_local = ring;
+    return ring;
+}
+
+void vnc_trace_span(const char *name, uint64_t start, uint64_t end)
+{
+    trace_ring_t *ring = trace_ring();
+    trace_event_t *ev;
+
+    if( unlikely(!ring) )
+    {
+        return;
+    }
+
+    ev = &ring->events[ring->head % VNC_TRACE_EVENTS];
+    ev->start = start;
+    ev->end = end;
+    ev->name = name;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void vnc_trace_thread(const char *name)
+{
+    trace_ring_t *ring = trace_ring();
+
+    if( ring && name )
+    {
+        pthread_mutex_lock(&trace.lock);
+        strncpy(ring->name, name, sizeof ring->name - 1);
+        pthread_mutex_unlock(&trace.lock);
+    }
+}
+
+// thread names come from config files, keep them from breaking the json
+static void trace_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for( ; *str; str++ )
+    {
+        if( *str == '"' || *str == '\\' )
+        {
+            fputc('\\', out);
+        }
+        if( (unsigned char)*str >= 0x20 )
+        {
+            fputc(*str, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// events being overwritten while the dump runs can come out torn, which is fine for a trace
+int vnc_trace_dump(const char *path)
+{
+    trace_ring_t *ring;
+    uint64_t head, i;
+    const char *sep = "";
+    int pid = (int)getpid();
+    FILE *out;
+
+    out = fopen(path, "w");
+    if( !out )
+    {
+        fprintf(stderr, "could not write trace '%s'.\n", path);
+        return 0;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    pthread_mutex_lock(&trace.lock);
+    for( ring = trace.rings; ring; ring = ring->next )
+    {
+        if( ring->name[0] )
+        {
+            fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":", sep, pid, ring->tid);
+            trace_string(out, ring->name);
+            fprintf(out, "}}");
+            sep = ",";
+        }
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for( i = head > VNC_TRACE_EVENTS ? head - VNC_TRACE_EVENTS : 0; i < head; i++ )
+        {
+            const trace_event_t *ev = &ring->events[i % VNC_TRACE_EVENTS];
+
+            fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    sep, ev->name, pid, ring->tid, ev->start / 1e3, (ev->end - ev->start) / 1e3);
+            sep = ",";
+        }
+    }
+    pthread_mutex_unlock(&trace.lock);
+
+    fprintf(out, "\n]}\n");
+
+    return fclose(out) == 0;
+}
+
+#else
+
+int vnc_trace_dump(const char *path)
+{
+    (void)path;
+    fprintf(stderr, "tracing is not compiled in.\n");
+    return 0;
+}
+
+#endif
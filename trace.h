@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "vnc.h"
+
+// trace points, only compiled in when VNC_TRACE is defined (qmake CONFIG+=trace)
+// every thread records complete events into its own ring, and vnc_trace_dump
+// writes all rings out in the chrome trace event format for chrome://tracing or perfetto
+//
+//     VNC_TRACE_VAR(t)                  with the other declarations, no semicolon
+//     VNC_TRACE_START(t);
+//     ...
+//     VNC_TRACE_SPAN("decode", t);      records t until now, then moves t to now
+
+// events kept per thread, older ones are overwritten
+#define VNC_TRACE_EVENTS 16384
+
+#ifdef VNC_TRACE
+void vnc_trace_span(const char *name, uint64_t start, uint64_t end);
+void vnc_trace_thread(const char *name);
+
+#define VNC_TRACE_VAR(t) uint64_t t;
+#define VNC_TRACE_START(t) t = vnc_time_ns()
+#define VNC_TRACE_SPAN(name, t) \
+    do \
+    { \
+        uint64_t trace_end_ = vnc_time_ns(); \
+        vnc_trace_span(name, t, trace_end_); \
+        t = trace_end_; \
+    } \
+    while( 0 )
+#define VNC_TRACE_THREAD(name) vnc_trace_thread(name)
+#else
+#define VNC_TRACE_VAR(t)
+#define VNC_TRACE_START(t) do { } while( 0 )
+#define VNC_TRACE_SPAN(name, t) do { } while( 0 )
+#define VNC_TRACE_THREAD(name) do { } while( 0 )
+#endif
+
+// returns 0 if tracing isn't compiled in or the file can't be written
+int vnc_trace_dump(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
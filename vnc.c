@@ -1,5 +1,6 @@
 #include "rfbproto.h"
 #include "vnc.h"
+#include "trace.h"
 
 #include <time.h>
 #include <unistd.h>
@@ -14,29 +15,65 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 
-// blocks until all bytes are read from socket
-static inline int rfb_read(int sock, void *out, unsigned int n)
+// monotonic clock used for all timing
+uint64_t vnc_time_ns(void)
 {
-    size_t len = recv(sock, out, (size_t)n, MSG_WAITALL);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// blocks until all bytes are read from socket, or takes them from the replay buffer
+static inline int rfb_read(vnc_t *vnc, void *out, unsigned int n)
+{
+    size_t len;
+
+    if( unlikely(vnc->replay != NULL) )
+    {
+        if( vnc->replay_len - vnc->replay_pos < n )
+        {
+            return 0;
+        }
+        memcpy(out, vnc->replay + vnc->replay_pos, n);
+        vnc->replay_pos += n;
+        return 1;
+    }
+
+    len = recv(vnc->sock, out, (size_t)n, MSG_WAITALL);
     if( len != n )
     {
         return 0;
     }
+    vnc_count(&vnc->stats.bytes, n);
+    if( unlikely(vnc->record != NULL) )
+    {
+        vnc_record_data(vnc->record, out, n);
+    }
     return 1;
 }
 
 // attempts to write data to socket
-static int rfb_write(int sock, void *out, size_t n)
+// there is no server to answer a replayed stream, so anything sent is dropped
+static int rfb_write(vnc_t *vnc, void *out, size_t n)
 {
     fd_set fds;
     uint8_t *buf = out;
+    int sock = vnc->sock;
     int i = 0;
     int j;
 
+    if( unlikely(vnc->replay != NULL) )
+    {
+        return 1;
+    }
+
     while (i < (int)n) {
         j = write(sock, buf + i, n - i);
         if( j <= 0 )
@@ -50,7 +87,7 @@ static int rfb_write(int sock, void *out, size_t n)
 
                     if( select(sock + 1, NULL, &fds, NULL, NULL) <= 0 )
                     {
-                        fprintf(stderr, "select failed.\n");
+                        vnc_log(vnc, VNC_LOG_ERROR, "select failed.");
                         return 0;
                     }
 
@@ -58,13 +95,13 @@ static int rfb_write(int sock, void *out, size_t n)
                 }
                 else
                 {
-                    fprintf(stderr, "write failed.\n");
+                    vnc_log(vnc, VNC_LOG_ERROR, "write failed.");
                     return 0;
                 }
             }
             else
             {
-                fprintf(stderr, "write failed bad.\n");
+                vnc_log(vnc, VNC_LOG_ERROR, "write failed bad.");
                 return 0;
             }
         }
@@ -83,7 +120,7 @@ int rfb_negotiate_link(vnc_t *vnc)
     char minor_str[4];
 
     // read the protocol version
-    if( !rfb_read(vnc->sock, &msg, sz_rfbProtocolVersionMsg) )
+    if( !rfb_read(vnc, &msg, sz_rfbProtocolVersionMsg) )
     {
         return 0;
     }
@@ -91,7 +128,7 @@ int rfb_negotiate_link(vnc_t *vnc)
     // check socket header match
     if( msg[0] != 'R' || msg[1] != 'F' || msg[2] != 'B' || msg[3] != ' ' || msg[7] != '.' )
     {
-        fprintf(stderr, "not a valid rfb socket.\n");
+        vnc_log(vnc, VNC_LOG_ERROR, "not a valid rfb socket.");
         return 0;
     }
     msg[11] = 0;
@@ -110,7 +147,7 @@ int rfb_negotiate_link(vnc_t *vnc)
     server_major = strtol((const char*)&major_str, NULL, 10);
     server_minor = strtol((const char*)&minor_str, NULL, 10);
 
-    fprintf(stdout, "server protocol version: %s\n", msg);
+    vnc_log(vnc, VNC_LOG_DEBUG, "server protocol version: %s", msg);
 
     if( server_major == 3 && server_minor >= 8 )
     {
@@ -126,9 +163,9 @@ int rfb_negotiate_link(vnc_t *vnc)
     }
 
     sprintf(msg, rfbProtocolVersionFormat, rfbProtocolMajorVersion, vnc->version);
-    fprintf(stdout, "client tries protocol: %s", msg);
+    vnc_log(vnc, VNC_LOG_DEBUG, "client tries protocol: %s", msg);
 
-    if( !rfb_write(vnc->sock, msg, sz_rfbProtocolVersionMsg) )
+    if( !rfb_write(vnc, msg, sz_rfbProtocolVersionMsg) )
     {
         return 0;
     }
@@ -147,14 +184,14 @@ int rfb_authenticate_link(vnc_t *vnc) {
         CARD8 num_sec_types;
         CARD8 *sec_types;
 
-        if( !rfb_read(vnc->sock, &num_sec_types, sizeof num_sec_types) )
+        if( !rfb_read(vnc, &num_sec_types, sizeof num_sec_types) )
         {
             return 0;
         }
 
         if( num_sec_types == 0 )
         {
-            fprintf(stderr, "connection error.\n");
+            vnc_log(vnc, VNC_LOG_ERROR, "connection error.");
             return 0;
         }
 
@@ -165,7 +202,7 @@ int rfb_authenticate_link(vnc_t *vnc) {
             return 0;
         }
 
-        if( !rfb_read(vnc->sock, sec_types, num_sec_types) )
+        if( !rfb_read(vnc, sec_types, num_sec_types) )
         {
             free(sec_types);
             return 0;
@@ -181,7 +218,7 @@ int rfb_authenticate_link(vnc_t *vnc) {
 
         free(sec_types);
 
-        if( !rfb_write(vnc->sock, &sec_type, sizeof sec_type) )
+        if( !rfb_write(vnc, &sec_type, sizeof sec_type) )
         {
             return 0;
         }
@@ -190,14 +227,14 @@ int rfb_authenticate_link(vnc_t *vnc) {
     }
     else
     {
-        if( !rfb_read(vnc->sock, &scheme, sizeof scheme))
+        if( !rfb_read(vnc, &scheme, sizeof scheme))
         {
             return 0;
         }
         scheme = ENDIAN32(scheme);
         if( scheme == rfbSecTypeInvalid )
         {
-            fprintf(stderr, "connection error.\n");
+            vnc_log(vnc, VNC_LOG_ERROR, "connection error.");
             return 0;
         }
     }
@@ -206,12 +243,12 @@ int rfb_authenticate_link(vnc_t *vnc) {
     {
         default:
         case rfbSecTypeInvalid:
-            fprintf(stdout, "no supported security type available.\n");
+            vnc_log(vnc, VNC_LOG_ERROR, "no supported security type available.");
             break;
         case rfbSecTypeNone:
             if( vnc->version >= 8 )
             {
-                if( !rfb_read(vnc->sock, &auth_result, sizeof auth_result) )
+                if( !rfb_read(vnc, &auth_result, sizeof auth_result) )
                 {
                     return 0;
                 }
@@ -220,16 +257,16 @@ int rfb_authenticate_link(vnc_t *vnc) {
 
                 switch(auth_result) {
                     case rfbVncAuthOK:
-                        fprintf(stdout, "authentication ok!\n");
+                        vnc_log(vnc, VNC_LOG_DEBUG, "authentication ok!");
                         return 1;
                     case rfbVncAuthFailed:
-                        fprintf(stdout, "authentication failed.\n");
+                        vnc_log(vnc, VNC_LOG_ERROR, "authentication failed.");
                         break;
                     case rfbVncAuthTooMany:
-                        fprintf(stdout, "too many connections.\n");
+                        vnc_log(vnc, VNC_LOG_ERROR, "too many connections.");
                         break;
                     default:
-                        fprintf(stdout, "unknown authentication error 0x%08X.\n", auth_result);
+                        vnc_log(vnc, VNC_LOG_ERROR, "unknown authentication error 0x%08X.", auth_result);
                         break;
                 }
             }
@@ -239,6 +276,18 @@ int rfb_authenticate_link(vnc_t *vnc) {
     return 0;
 }
 
+// a framebuffer geometry the server asks for has to fit the buffer it is decoded into
+// rectangles are only checked against the geometry, so this is what keeps them in bounds
+static int rfb_geometry_fits(vnc_t *vnc, unsigned int width, unsigned int height, unsigned int pixelsize)
+{
+    if( unlikely(!pixelsize || (uint64_t)width * height * pixelsize > VNC_BUF_SIZE) )
+    {
+        vnc_log(vnc, VNC_LOG_ERROR, "framebuffer %ux%u at %u bytes per pixel doesn't fit.", width, height, pixelsize);
+        return 0;
+    }
+    return 1;
+}
+
 // get the server configuration
 // also tell the server about us
 int rfb_initialize_server(vnc_t *vnc)
@@ -248,12 +297,12 @@ int rfb_initialize_server(vnc_t *vnc)
     rfbClientInitMsg cl;
     cl.shared = 1;
 
-    if( !rfb_write(vnc->sock, &cl, sz_rfbClientInitMsg) )
+    if( !rfb_write(vnc, &cl, sz_rfbClientInitMsg) )
     {
         return 0;
     }
 
-    if( !rfb_read(vnc->sock, &si, sz_rfbServerInitMsg) )
+    if( !rfb_read(vnc, &si, sz_rfbServerInitMsg) )
     {
         return 0;
     }
@@ -275,23 +324,25 @@ int rfb_initialize_server(vnc_t *vnc)
     vnc->server.pixelsize = vnc->server.bpp / 8;
     vnc->server.stride = vnc->server.width * vnc->server.pixelsize;
 
-    if( !rfb_read(vnc->sock, vnc->server.name, len) )
+    if( !rfb_read(vnc, vnc->server.name, len) )
     {
         return 0;
     }
     vnc->server.name[len] = 0;
 
-    fprintf(stdout, "server \'%s\' configuration:\n", vnc->server.name);
-    fprintf(stdout, "  width: %d\theight: %d\n", vnc->server.width, vnc->server.height);
-    fprintf(stdout, "  bpp: %d\tdepth: %d\n", vnc->server.bpp, vnc->server.depth);
-    fprintf(stdout, "  bigendian: %d\ttruecolor: %d\n", vnc->server.bigendian, vnc->server.truecolour);
-    fprintf(stdout, "  redmax: %d\tgreenmax: %d\tbluemax: %d\n", vnc->server.redmax, vnc->server.greenmax, vnc->server.bluemax);
-    fprintf(stdout, "  redshift: %d\tgreenshift: %d\tblueshift: %d\n", vnc->server.redshift, vnc->server.greenshift, vnc->server.blueshift);
+    if( !rfb_geometry_fits(vnc, vnc->server.width, vnc->server.height, vnc->server.pixelsize) )
+    {
+        return 0;
+    }
+
+    vnc_log(vnc, VNC_LOG_DEBUG, "server \'%s\' %ux%u, bpp %u depth %u, bigendian %u truecolor %u, max %u/%u/%u shift %u/%u/%u",
+            vnc->server.name, vnc->server.width, vnc->server.height,
+            vnc->server.bpp, vnc->server.depth, vnc->server.bigendian, vnc->server.truecolour,
+            vnc->server.redmax, vnc->server.greenmax, vnc->server.bluemax,
+            vnc->server.redshift, vnc->server.greenshift, vnc->server.blueshift);
     return 1;
 }
 
-#define NUM_ENCODINGS 2
-
 typedef struct
 {
     rfbSetEncodingsMsg msg;
@@ -304,69 +355,302 @@ encoding_t;
 int rfb_negotiate_frame_format(vnc_t *vnc)
 {
     encoding_t em;
+    unsigned int n = 0;
     em.msg.type = rfbSetEncodings;
 
-    em.enc[0] = ENDIAN32(rfbEncodingRaw);
-    em.enc[1] = ENDIAN32(rfbEncodingNewFBSize);
+    em.enc[n++] = ENDIAN32(rfbEncodingCopyRect);
+    em.enc[n++] = ENDIAN32(rfbEncodingRaw);
+    em.enc[n++] = ENDIAN32(rfbEncodingExtDesktopSize);
+    em.enc[n++] = ENDIAN32(rfbEncodingNewFBSize);
+    if( !vnc->cfg.disable_cursor )
+    {
+        em.enc[n++] = ENDIAN32(rfbEncodingRichCursor);
+        em.enc[n++] = ENDIAN32(rfbEncodingXCursor);
+        em.enc[n++] = ENDIAN32(rfbEncodingPointerPos);
+    }
+    if( !vnc->cfg.disable_continuous )
+    {
+        em.enc[n++] = ENDIAN32(rfbEncodingContinuousUpdates);
+        em.enc[n++] = ENDIAN32(rfbEncodingFence);
+    }
 
-    em.msg.nEncodings = ENDIAN16(NUM_ENCODINGS);
+    em.msg.nEncodings = ENDIAN16(n);
 
-    fprintf(stdout, "set encoding types: %d, %lu\n", NUM_ENCODINGS, NUM_ENCODINGS * sizeof(CARD32));
+    vnc_log(vnc, VNC_LOG_DEBUG, "set encoding types: %u, %lu", n, n * sizeof(CARD32));
 
-    if( !rfb_write(vnc->sock, &em, sz_rfbSetEncodingsMsg + (NUM_ENCODINGS * sizeof(CARD32))) )
+    if( !rfb_write(vnc, &em, sz_rfbSetEncodingsMsg + (n * sizeof(CARD32))) )
     {
         return 0;
     }
 
-    fprintf(stdout, "configured encoding types.\n");
+    vnc_log(vnc, VNC_LOG_DEBUG, "configured encoding types.");
 
     return 1;
 }
 
-void vnc_vm_off(vnc_t *vnc)
+// grows a rectangle so that it also covers another one
+static void vnc_rect_union(vnc_rect_t *dst, const vnc_rect_t *src)
+{
+    unsigned int x1 = dst->x + dst->w;
+    unsigned int y1 = dst->y + dst->h;
+
+    if( src->x + src->w > x1 )
+    {
+        x1 = src->x + src->w;
+    }
+    if( src->y + src->h > y1 )
+    {
+        y1 = src->y + src->h;
+    }
+    if( src->x < dst->x )
+    {
+        dst->x = src->x;
+    }
+    if( src->y < dst->y )
+    {
+        dst->y = src->y;
+    }
+
+    dst->w = x1 - dst->x;
+    dst->h = y1 - dst->y;
+}
+
+// records a changed region of the framebuffer
+// once the list is full it collapses into a single bounding box
+static void vnc_add_damage(vnc_t *vnc, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+    scrn_status_t *status = &vnc->status;
+    vnc_rect_t rect = { x, y, w, h };
+    unsigned int i;
+
+    if( unlikely(w == 0 || h == 0) )
+    {
+        return;
+    }
+
+    if( unlikely(status->num_damage >= VNC_MAX_DAMAGE) )
+    {
+        for( i = 0; i < status->num_damage; i++ )
+        {
+            vnc_rect_union(&rect, &status->damage[i]);
+        }
+        status->num_damage = 0;
+    }
+
+    status->damage[status->num_damage++] = rect;
+}
+
+// marks the whole screen as changed
+static void vnc_damage_all(vnc_t *vnc)
+{
+    vnc->status.num_damage = 0;
+    vnc_add_damage(vnc, 0, 0, vnc->server.width, vnc->server.height);
+}
+
+// publishes the damage list, and the row range covering it for simple consumers
+static void vnc_commit_damage(vnc_t *vnc)
+{
+    scrn_status_t *status = &vnc->status;
+    unsigned int miny = UINT_MAX;
+    unsigned int maxy = 0;
+    unsigned int i;
+
+    for( i = 0; i < status->num_damage; i++ )
+    {
+        if( status->damage[i].y < miny )
+        {
+            miny = status->damage[i].y;
+        }
+        if( status->damage[i].y + status->damage[i].h > maxy )
+        {
+            maxy = status->damage[i].y + status->damage[i].h;
+        }
+    }
+
+    if( miny > maxy )
+    {
+        miny = maxy = 0;
+    }
+
+    status->update_offset = miny * vnc->server.stride;
+    status->update_size = (maxy - miny) * vnc->server.stride;
+    status->updated = 1;
+}
+
+static uint8_t off_image[VNC_DEACTIVE_VRES * VNC_DEACTIVE_HRES * VNC_DEACTIVE_PIXEL_SIZE];
+static pthread_once_t off_once = PTHREAD_ONCE_INIT;
+
+// draws the off screen once, the 'off' image centered on black
+static void off_image_decode(void)
 {
-    unsigned int stride;
-    unsigned int height;
+    const unsigned char *src = vm_off_rle;
+    const unsigned char *end = vm_off_rle + vm_off_rle_len;
+    unsigned int stride = VNC_DEACTIVE_HRES * VNC_DEACTIVE_PIXEL_SIZE;
+    unsigned int n, i = 0;
+    unsigned int total = VNC_DEACTIVE_IMG_HRES * VNC_DEACTIVE_IMG_VRES;
     uint8_t *dst;
-    const uint8_t *src;
+    int run;
+
+    while( src < end && i < total )
+    {
+        run = *src < 128;
+        n = run ? *src + 1u : *src - 127u;
+        src++;
+
+        while( n-- && i < total && end - src >= 3 )
+        {
+            dst = off_image + ((VNC_DEACTIVE_IMG_Y + i / VNC_DEACTIVE_IMG_HRES) * stride) +
+                  ((VNC_DEACTIVE_IMG_X + i % VNC_DEACTIVE_IMG_HRES) * VNC_DEACTIVE_PIXEL_SIZE);
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            dst[3] = 0xff;
+            i++;
+            if( !run )
+            {
+                src += 3;
+            }
+        }
+        if( run )
+        {
+            src += 3;
+        }
+    }
+}
+
+// the complete 800x600 off screen, read only and shared by every display
+const uint8_t *vnc_off_image(void)
+{
+    pthread_once(&off_once, off_image_decode);
+    return off_image;
+}
+
+// blanks the current geometry only, the rest of the buffer is never shown
+static void vnc_clear(vnc_t *vnc)
+{
+    vnc_begin_write(vnc);
+    memset(vnc_framebuffer(vnc), 0, (size_t)vnc->server.stride * vnc->server.height);
+}
+
+// sets the guest monitors, clipped to the framebuffer
+// without a layout (count 0) a single monitor covers the whole framebuffer
+void vnc_set_screens(vnc_t *vnc, const vnc_screen_t *screens, unsigned int count)
+{
+    vnc_screen_t *dst = vnc->status.screens;
+    unsigned int i, n = 0;
+
+    for( i = 0; i < count && n < VNC_MAX_SCREENS; i++ )
+    {
+        const vnc_rect_t *r = &screens[i].rect;
 
-    // update the screen status anyway
-    memset(vnc->buf, 0, VNC_BUF_SIZE);
+        if( r->x >= vnc->server.width || r->y >= vnc->server.height || !r->w || !r->h )
+        {
+            continue;
+        }
+
+        dst[n].id = screens[i].id;
+        dst[n].rect.x = r->x;
+        dst[n].rect.y = r->y;
+        dst[n].rect.w = r->w < vnc->server.width - r->x ? r->w : vnc->server.width - r->x;
+        dst[n].rect.h = r->h < vnc->server.height - r->y ? r->h : vnc->server.height - r->y;
+        n++;
+    }
+
+    if( !n )
+    {
+        dst[0].id = 0;
+        dst[0].rect.x = 0;
+        dst[0].rect.y = 0;
+        dst[0].rect.w = vnc->server.width;
+        dst[0].rect.h = vnc->server.height;
+        n = 1;
+    }
+
+    vnc->status.num_screens = n;
+}
+
+void vnc_vm_off(vnc_t *vnc)
+{
+    const uint8_t *off = vnc_off_image();
 
-    // draw the 'off' image
     vnc->server.stride = VNC_DEACTIVE_HRES * VNC_DEACTIVE_PIXEL_SIZE;
     vnc->server.width = VNC_DEACTIVE_HRES;
     vnc->server.height = VNC_DEACTIVE_VRES;
     vnc->server.pixelsize = VNC_DEACTIVE_PIXEL_SIZE;
 
-    src = vm_off_bin;
-    dst = vnc->buf + (VNC_DEACTIVE_IMG_Y * vnc->server.stride) + (VNC_DEACTIVE_IMG_X * vnc->server.pixelsize);
-    height = VNC_DEACTIVE_IMG_VRES;
-    stride = VNC_DEACTIVE_IMG_HRES * vnc->server.pixelsize;
+    // readers of a user buffer look at the memory itself rather than vnc_pixels()
+    if( vnc->cfg.use_buffer )
+    {
+        vnc_begin_write(vnc);
+        memcpy(vnc->cfg.buffer, off, sizeof off_image);
+    }
 
-    while( height-- )
+    vnc_set_screens(vnc, NULL, 0);
+
+    // no pointer over the placeholder, the next connection sends its own shape
+    vnc->cursor.width = vnc->cursor.height = 0;
+    vnc->cursor.serial++;
+    vnc->cursor.updated = 1;
+
+    vnc->status.fbsize_updated = 1;
+    vnc->status.off = 1;
+    vnc_damage_all(vnc);
+    vnc_commit_damage(vnc);
+}
+
+// replaces the screen with a complete frame, rows packed, used by playback
+int vnc_load_frame(vnc_t *vnc, unsigned int width, unsigned int height, unsigned int pixelsize, const uint8_t *pixels)
+{
+    size_t row = (size_t)width * pixelsize;
+    uint8_t *dst = vnc_framebuffer(vnc);
+    unsigned int y;
+
+    if( !pixelsize || row * height > VNC_BUF_SIZE )
+    {
+        return 0;
+    }
+
+    vnc->server.width = width;
+    vnc->server.height = height;
+    vnc->server.pixelsize = pixelsize;
+    vnc->server.stride = (unsigned int)row;
+
+    vnc_begin_write(vnc);
+    for( y = 0; y < height; y++ )
     {
-        memcpy(dst, src, stride);
+        memcpy(dst, pixels, row);
         dst += vnc->server.stride;
-        src += stride;
+        pixels += row;
     }
 
+    vnc_set_screens(vnc, NULL, 0);
     vnc->status.fbsize_updated = 1;
-    vnc->status.updated = 1;
-    vnc->status.update_size = VNC_DEACTIVE_HRES * VNC_DEACTIVE_VRES * VNC_DEACTIVE_PIXEL_SIZE;
-    vnc->status.update_offset = 0;
+    vnc->status.off = 0;
+    vnc_damage_all(vnc);
+    vnc_commit_damage(vnc);
+
+    return 1;
 }
 
 int rfb_disconnect(vnc_t *vnc)
 {
     int status = close(vnc->sock);
-    fprintf(stdout, "disconnected.\n");
-    fflush(stdout);
+    vnc_governor_leave(vnc);
 
-    // update the screen status anyway
-    memset(vnc->buf, 0, VNC_BUF_SIZE);
+    // servers without scaling support may hang up on rfbSetScale, scale here from now on
+    // only when nothing came back after it, a drop later on is some other fault
+    if( vnc->scale.sent && !vnc->scale.refused )
+    {
+        vnc_log(vnc, VNC_LOG_WARN, "connection lost after asking the server to scale, scaling here instead.");
+        vnc->scale.refused = 1;
+    }
+    if( vnc->record )
+    {
+        vnc_record_disconnect(vnc);
+    }
+    vnc_log(vnc, VNC_LOG_INFO, "disconnected.");
 
-    // show the off state
+    // show the off state, the buffer is cleared when the next connection sets its size
     vnc_vm_off(vnc);
 
     return status;
@@ -376,7 +660,7 @@ int rfb_cut_text_message(vnc_t *vnc, rfbServerToClientMsg *msg) {
     CARD32 size;
     char *buf;
 
-    if( !rfb_read(vnc->sock, ((char*)&msg->sct) + 1, sz_rfbServerCutTextMsg - 1) )
+    if( !rfb_read(vnc, ((char*)&msg->sct) + 1, sz_rfbServerCutTextMsg - 1) )
     {
         return 0;
     }
@@ -388,7 +672,7 @@ int rfb_cut_text_message(vnc_t *vnc, rfbServerToClientMsg *msg) {
         return 0;
     }
 
-    if( !rfb_read(vnc->sock, buf, size) )
+    if( !rfb_read(vnc, buf, size) )
     {
         free(buf);
         return 0;
@@ -396,32 +680,48 @@ int rfb_cut_text_message(vnc_t *vnc, rfbServerToClientMsg *msg) {
 
     buf[size] = 0;
 
-    fprintf(stdout, "text msg: %s\n", buf);
+    vnc_log(vnc, VNC_LOG_DEBUG, "text msg: %s", buf);
 
     free(buf);
     return 1;
 }
 
+// regions of interest make servers send partial rectangles, never trust them to stay on screen
+static inline int rfb_rect_valid(vnc_t *vnc, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+    if( unlikely(x + w > vnc->server.width || y + h > vnc->server.height) )
+    {
+        vnc_log(vnc, VNC_LOG_WARN, "rectangle out of bounds.");
+        return 0;
+    }
+    return 1;
+}
+
 static int rfb_enc_raw(vnc_t *vnc, rfbFramebufferUpdateRectHeader rectheader)
 {
     unsigned int height = rectheader.r.h;
     unsigned int stride = rectheader.r.w * vnc->server.pixelsize;
     uint8_t *buf;
 
-    buf = vnc->buf + (rectheader.r.y * vnc->server.stride) + (rectheader.r.x * vnc->server.pixelsize);
+    if( unlikely(!rfb_rect_valid(vnc, rectheader.r.x, rectheader.r.y, rectheader.r.w, rectheader.r.h)) )
+    {
+        return 0;
+    }
+
+    buf = vnc_framebuffer(vnc) + (rectheader.r.y * vnc->server.stride) + (rectheader.r.x * vnc->server.pixelsize);
 
     // optimize the case where data spans the whole screen
     // this doesn't actually help; because packets are huge
     /*if( rectheader.r.x == 0 && stride == vnc->server.width )
     {
-        if( !rfb_read(vnc->sock, buf, height * stride))
+        if( !rfb_read(vnc, buf, height * stride))
         {
             return 0;
         }
     }*/
     while( height-- )
     {
-        if( unlikely(!rfb_read(vnc->sock, buf, stride)) )
+        if( unlikely(!rfb_read(vnc, buf, stride)) )
         {
             return 0;
         }
@@ -432,214 +732,1060 @@ static int rfb_enc_raw(vnc_t *vnc, rfbFramebufferUpdateRectHeader rectheader)
     return 1;
 }
 
-static int rfb_request_frame(vnc_t *vnc, uint8_t incr)
+// move a block of the existing framebuffer, mostly used for scrolling
+static int rfb_enc_copyrect(vnc_t *vnc, rfbFramebufferUpdateRectHeader rectheader)
 {
-    static rfbFramebufferUpdateRequestMsg fur = { 0 };
-
-    fur.type = rfbFramebufferUpdateRequest;
-    fur.incremental = incr;
-    fur.x = 0;
-    fur.y = 0;
-    fur.w = ENDIAN16(vnc->server.width);
-    fur.h = ENDIAN16(vnc->server.height);
+    unsigned int height = rectheader.r.h;
+    unsigned int stride = rectheader.r.w * vnc->server.pixelsize;
+    uint8_t *fb = vnc_framebuffer(vnc);
+    uint8_t *src, *dst;
+    rfbCopyRect cr;
+    long step;
 
-    if( unlikely(!rfb_write(vnc->sock, &fur, sz_rfbFramebufferUpdateRequestMsg)) )
+    if( unlikely(!rfb_read(vnc, &cr, sz_rfbCopyRect)) )
     {
-        fprintf(stdout, "request error.\n");
-        rfb_disconnect(vnc);
         return 0;
     }
-    return 1;
-}
 
-// handles incomming messages from the vnc server
-// this is where the dma operations should take place
-// pass it a pointer and it will tell you if you need to
-// refresh the screen that is in the buffer
-static int rfb_handle_message(vnc_t *vnc)
-{
-    rfbFramebufferUpdateRectHeader rectheader;
-    rfbServerToClientMsg msg;
-    uint16_t i;
-    int miny = INT_MAX;
-    int maxy = INT_MIN;
+    cr.srcX = ENDIAN16(cr.srcX);
+    cr.srcY = ENDIAN16(cr.srcY);
 
-    if( unlikely(!rfb_read(vnc->sock, &msg, 1)) )
+    if( unlikely(!rfb_rect_valid(vnc, rectheader.r.x, rectheader.r.y, rectheader.r.w, rectheader.r.h) ||
+                 !rfb_rect_valid(vnc, cr.srcX, cr.srcY, rectheader.r.w, rectheader.r.h)) )
     {
         return 0;
     }
 
-    switch( msg.type )
-    {
-        case rfbFramebufferUpdate:
-            if( unlikely(!rfb_read(vnc->sock, ((char*)&msg.fu) + 1, sz_rfbFramebufferUpdateMsg - 1)) )
-            {
-                return 0;
-            }
-            msg.fu.nRects = ENDIAN16(msg.fu.nRects);
-            for( i = 0; i < msg.fu.nRects; i++ )
-            {
-                int result = 0;
-                if( unlikely(!rfb_read(vnc->sock, &rectheader, sz_rfbFramebufferUpdateRectHeader)) )
-                {
-                    return 0;
-                }
-
-                rectheader.r.x = ENDIAN16(rectheader.r.x);
-                rectheader.r.y = ENDIAN16(rectheader.r.y);
-                rectheader.r.w = ENDIAN16(rectheader.r.w);
-                rectheader.r.h = ENDIAN16(rectheader.r.h);
-
-                // used for determining what region of the screen to update
-                if( rectheader.r.y < miny )
-                {
-                    miny = rectheader.r.y;
-                }
-                if( (rectheader.r.y + rectheader.r.h) > maxy )
-                {
-                    maxy = rectheader.r.y + rectheader.r.h;
-                }
-
-                switch( ENDIAN32(rectheader.encoding) )
-                {
-                    case rfbEncodingRaw:
-                        result = rfb_enc_raw(vnc, rectheader);
-                        break;
-                    case rfbEncodingNewFBSize:
-                        vnc->server.width = rectheader.r.w;
-                        vnc->server.height = rectheader.r.h;
-                        vnc->server.stride = vnc->server.width * vnc->server.pixelsize;
-                        vnc->urq.w = ENDIAN16(vnc->server.width);
-                        vnc->urq.h = ENDIAN16(vnc->server.height);
-                        vnc->status.fbsize_updated = 1;
-                        vnc->status.updated = 1;
-
-                        // update the screen on resize
-                        memset(vnc->buf, 0, VNC_BUF_SIZE);
-                        miny = 0;
-                        maxy = vnc->server.height;
-                        fprintf(stdout, "resize requested: %dx%d\n", rectheader.r.w, rectheader.r.h);
-                        fflush(stdout);
-                        result = 1;
-                        break;
-                    case rfbEncodingLastRect:
-                        result = 1;
-                        break;
-                    default:
-                        fprintf(stdout, "unknwon request: %d", ENDIAN32(rectheader.encoding));
-                        break;
-                }
+    src = fb + (cr.srcY * vnc->server.stride) + (cr.srcX * vnc->server.pixelsize);
+    dst = fb + (rectheader.r.y * vnc->server.stride) + (rectheader.r.x * vnc->server.pixelsize);
+    step = vnc->server.stride;
 
-                if( !result )
-                {
-                    fprintf(stdout, "encoding failed.\n");
-                    return 0;
-                }
-            }
-            rfb_request_frame(vnc, 1);
+    // walk rows in the direction that doesn't overwrite rows not yet copied
+    if( cr.srcY < rectheader.r.y && height )
+    {
+        src += (height - 1) * vnc->server.stride;
+        dst += (height - 1) * vnc->server.stride;
+        step = -step;
+    }
 
-            // inform the user of the updated range
-            // this prevents copying of the entire buffer, and instead just the updated rectangle
-            vnc->status.updated = 1;
-            vnc->status.update_offset = miny * vnc->server.stride;
-            vnc->status.update_size = (maxy - miny) * vnc->server.stride;
-            break;
-        case rfbSetColourMapEntries:
-            rfb_read(vnc->sock, ((char*)&msg.scme) + 1, sz_rfbSetColourMapEntriesMsg - 1);
-            break;
-        case rfbBell:
-            break;
-        case rfbServerCutText:
-            if( !rfb_cut_text_message(vnc, &msg) )
-            {
-                return 0;
-            }
-            break;
-        default:
-            fprintf(stdout, "encoding failed.\n");
-            return 0;
+    while( height-- )
+    {
+        memmove(dst, src, stride);
+        src += step;
+        dst += step;
     }
+
     return 1;
 }
 
-int rfb_grab(vnc_t *vnc, int update)
+// throws away payload the client has no use for
+static int rfb_skip(vnc_t *vnc, size_t len)
 {
-    uint32_t buf;
+    uint8_t scratch[4096];
+    unsigned int n;
 
-    // check if the server disconnected
-    ssize_t connected = recv(vnc->sock, &buf, sizeof buf, MSG_PEEK | MSG_DONTWAIT);
-    if( unlikely(connected == 0) )
-    {
-        rfb_disconnect(vnc);
-        return 0;
-    }
-    else
+    while( len )
     {
-        // check for frames
-        if( unlikely(!rfb_handle_message(vnc)) )
+        n = len < sizeof scratch ? (unsigned int)len : sizeof scratch;
+        if( unlikely(!rfb_read(vnc, scratch, n)) )
         {
-            rfb_disconnect(vnc);
             return 0;
         }
-
-        // this is only for requesting a full frame update
-        if( unlikely(update) )
-        {
-            rfb_request_frame(vnc, 0);
-        }
+        len -= n;
     }
 
     return 1;
 }
 
-// connects to the hosted socket addresses
-// returns 0 if fatal error, 1 if success, and 2 if retry is needed
-int rfb_connect(vnc_t *vnc, const char *path, uint16_t port)
+// a colour in the server's pixel format
+static void rfb_make_pixel(vnc_t *vnc, const uint8_t *rgb, uint8_t *out)
 {
-    vnc->cfg.socket = path;
-    vnc->cfg.port = port;
+    uint32_t v;
+    unsigned int i;
 
-    // if port is used, assume tcp
-    if (port) {
-        struct sockaddr_in serv_addr;
+    v = ((rgb[0] * vnc->server.redmax + 127) / 255) << vnc->server.redshift |
+        ((rgb[1] * vnc->server.greenmax + 127) / 255) << vnc->server.greenshift |
+        ((rgb[2] * vnc->server.bluemax + 127) / 255) << vnc->server.blueshift;
 
-        if( (vnc->sock = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
-        {
-            fprintf(stdout, "socket error.\n");
-            return 0;
-        }
-        memset(&serv_addr, '0', sizeof(serv_addr));
+    for( i = 0; i < vnc->server.pixelsize; i++ )
+    {
+        out[vnc->server.bigendian ? vnc->server.pixelsize - 1 - i : i] = (uint8_t)(v >> (i * 8));
+    }
+}
 
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_port = htons(port);
+// expands a cursor bitmask, rows padded to whole bytes, to a byte per pixel
+static void rfb_cursor_mask(vnc_cursor_t *c, const uint8_t *bits)
+{
+    unsigned int row = (c->width + 7) / 8;
+    unsigned int x, y;
 
-        if( inet_pton(AF_INET, path, &serv_addr.sin_addr) <= 0 )
+    for( y = 0; y < c->height; y++ )
+    {
+        for( x = 0; x < c->width; x++ )
         {
-            fprintf(stdout, "invalid address.\n");
-            return 0;
+            c->mask[y * c->width + x] = bits[y * row + x / 8] & (0x80 >> (x % 8)) ? 0xff : 0;
         }
+    }
+}
 
-        // actually try to connect
+// a new cursor shape in the framebuffer's pixel format
+static int rfb_enc_rich_cursor(vnc_t *vnc, rfbFramebufferUpdateRectHeader rectheader)
+{
+    uint8_t bits[VNC_CURSOR_MAX / 8 * VNC_CURSOR_MAX];
+    vnc_cursor_t *c = &vnc->cursor;
+    unsigned int row = (rectheader.r.w + 7u) / 8;
+
+    c->updated = 1;
+    c->serial++;
+
+    if( rectheader.r.w > VNC_CURSOR_MAX || rectheader.r.h > VNC_CURSOR_MAX )
+    {
+        c->width = c->height = 0;
+        return rfb_skip(vnc, (size_t)rectheader.r.w * rectheader.r.h * vnc->server.pixelsize + (size_t)row * rectheader.r.h);
+    }
+
+    c->hotx = rectheader.r.x;
+    c->hoty = rectheader.r.y;
+    c->width = rectheader.r.w;
+    c->height = rectheader.r.h;
+
+    if( unlikely(!rfb_read(vnc, c->pixels, c->width * c->height * vnc->server.pixelsize) ||
+                 !rfb_read(vnc, bits, row * c->height)) )
+    {
+        c->width = c->height = 0;
+        return 0;
+    }
+
+    rfb_cursor_mask(c, bits);
+
+    return 1;
+}
+
+// a new two colour cursor shape, an empty one hides the cursor
+static int rfb_enc_xcursor(vnc_t *vnc, rfbFramebufferUpdateRectHeader rectheader)
+{
+    uint8_t bits[VNC_CURSOR_MAX / 8 * VNC_CURSOR_MAX];
+    uint8_t mask[VNC_CURSOR_MAX / 8 * VNC_CURSOR_MAX];
+    uint8_t fg[4], bg[4];
+    uint8_t rgb[6];
+    vnc_cursor_t *c = &vnc->cursor;
+    unsigned int row = (rectheader.r.w + 7u) / 8;
+    unsigned int ps = vnc->server.pixelsize;
+    unsigned int x, y;
+    uint8_t *dst;
+
+    c->updated = 1;
+    c->serial++;
+    c->width = c->height = 0;
+
+    if( !rectheader.r.w || !rectheader.r.h )
+    {
+        return 1;
+    }
+
+    if( rectheader.r.w > VNC_CURSOR_MAX || rectheader.r.h > VNC_CURSOR_MAX || ps > sizeof fg )
+    {
+        return rfb_skip(vnc, sizeof rgb + 2 * (size_t)row * rectheader.r.h);
+    }
+
+    if( unlikely(!rfb_read(vnc, rgb, sizeof rgb) ||
+                 !rfb_read(vnc, bits, row * rectheader.r.h) ||
+                 !rfb_read(vnc, mask, row * rectheader.r.h)) )
+    {
+        return 0;
+    }
+
+    rfb_make_pixel(vnc, rgb, fg);
+    rfb_make_pixel(vnc, rgb + 3, bg);
+
+    c->hotx = rectheader.r.x;
+    c->hoty = rectheader.r.y;
+    c->width = rectheader.r.w;
+    c->height = rectheader.r.h;
+
+    dst = c->pixels;
+    for( y = 0; y < c->height; y++ )
+    {
+        for( x = 0; x < c->width; x++ )
+        {
+            memcpy(dst, bits[y * row + x / 8] & (0x80 >> (x % 8)) ? fg : bg, ps);
+            dst += ps;
+        }
+    }
+
+    rfb_cursor_mask(c, mask);
+
+    return 1;
+}
+
+// draws the cursor over a copy of the framebuffer, for consumers that want it in their frames
+// dst has the framebuffer's pixel format, width and height clip the drawing
+void vnc_cursor_draw(vnc_t *vnc, uint8_t *dst, unsigned int stride, unsigned int width, unsigned int height)
+{
+    const vnc_cursor_t *c = &vnc->cursor;
+    unsigned int ps = vnc->server.pixelsize;
+    int left = (int)c->x - (int)c->hotx;
+    int top = (int)c->y - (int)c->hoty;
+    int x, y, cx, cy;
+
+    for( cy = 0; cy < (int)c->height; cy++ )
+    {
+        y = top + cy;
+        if( y < 0 || y >= (int)height )
+        {
+            continue;
+        }
+        for( cx = 0; cx < (int)c->width; cx++ )
+        {
+            x = left + cx;
+            if( x < 0 || x >= (int)width || !c->mask[cy * c->width + cx] )
+            {
+                continue;
+            }
+            memcpy(dst + (size_t)y * stride + (size_t)x * ps, c->pixels + ((size_t)cy * c->width + cx) * ps, ps);
+        }
+    }
+}
+
+static uint8_t *rfb_put_rect(uint8_t *out, unsigned int x, unsigned int y, unsigned int w, unsigned int h, uint32_t encoding)
+{
+    rfbFramebufferUpdateRectHeader rh;
+
+    rh.r.x = ENDIAN16((uint16_t)x);
+    rh.r.y = ENDIAN16((uint16_t)y);
+    rh.r.w = ENDIAN16((uint16_t)w);
+    rh.r.h = ENDIAN16((uint16_t)h);
+    rh.encoding = ENDIAN32(encoding);
+    memcpy(out, &rh, sz_rfbFramebufferUpdateRectHeader);
+
+    return out + sz_rfbFramebufferUpdateRectHeader;
+}
+
+// the current cursor as an update the server could have sent, so recordings can restore it
+// returns the length, out may be NULL to only get that
+size_t rfb_cursor_message(vnc_t *vnc, uint8_t *out)
+{
+    const vnc_cursor_t *c = &vnc->cursor;
+    unsigned int row = (c->width + 7) / 8;
+    size_t image = (size_t)c->width * c->height * vnc->server.pixelsize;
+    size_t len = sz_rfbFramebufferUpdateMsg + 2 * sz_rfbFramebufferUpdateRectHeader;
+    rfbFramebufferUpdateMsg fu;
+    unsigned int x, y;
+
+    if( c->width )
+    {
+        len += image + (size_t)row * c->height;
+    }
+    if( !out )
+    {
+        return len;
+    }
+
+    memset(&fu, 0, sizeof fu);
+    fu.type = rfbFramebufferUpdate;
+    fu.nRects = ENDIAN16(2);
+    memcpy(out, &fu, sz_rfbFramebufferUpdateMsg);
+    out += sz_rfbFramebufferUpdateMsg;
+
+    // an empty xcursor stands for no shape
+    if( c->width )
+    {
+        out = rfb_put_rect(out, c->hotx, c->hoty, c->width, c->height, rfbEncodingRichCursor);
+        memcpy(out, c->pixels, image);
+        out += image;
+        memset(out, 0, (size_t)row * c->height);
+        for( y = 0; y < c->height; y++ )
+        {
+            for( x = 0; x < c->width; x++ )
+            {
+                if( c->mask[y * c->width + x] )
+                {
+                    out[y * row + x / 8] |= 0x80 >> (x % 8);
+                }
+            }
+        }
+        out += (size_t)row * c->height;
+    }
+    else
+    {
+        out = rfb_put_rect(out, 0, 0, 0, 0, rfbEncodingXCursor);
+    }
+
+    rfb_put_rect(out, c->x, c->y, 0, 0, rfbEncodingPointerPos);
+
+    return len;
+}
+
+// requests in flight were merged or dropped by the server
+static inline void rfb_forget_requests(vnc_t *vnc)
+{
+    vnc->outstanding = 0;
+    vnc->stats.num_requests = 0;
+}
+
+// the parts of the screen to ask for, clipped to the current size
+static unsigned int rfb_regions(vnc_t *vnc, vnc_rect_t *out)
+{
+    unsigned int i, n = 0;
+    vnc_rect_t r;
+
+    if( likely(!vnc->num_roi) )
+    {
+        out[0].x = 0;
+        out[0].y = 0;
+        out[0].w = vnc->server.width;
+        out[0].h = vnc->server.height;
+        return 1;
+    }
+
+    for( i = 0; i < vnc->num_roi; i++ )
+    {
+        r = vnc->roi[i];
+        if( r.x >= vnc->server.width || r.y >= vnc->server.height )
+        {
+            continue;
+        }
+        if( r.x + r.w > vnc->server.width )
+        {
+            r.w = vnc->server.width - r.x;
+        }
+        if( r.y + r.h > vnc->server.height )
+        {
+            r.h = vnc->server.height - r.y;
+        }
+        if( r.w && r.h )
+        {
+            out[n++] = r;
+        }
+    }
+
+    return n;
+}
+
+// one request covers every region of interest, and counts once towards the window
+static int rfb_request_frame(vnc_t *vnc, uint8_t incr)
+{
+    rfbFramebufferUpdateRequestMsg fur[VNC_MAX_ROI];
+    vnc_rect_t regions[VNC_MAX_ROI];
+    unsigned int i, n;
+
+    n = rfb_regions(vnc, regions);
+    for( i = 0; i < n; i++ )
+    {
+        fur[i].type = rfbFramebufferUpdateRequest;
+        fur[i].incremental = incr;
+        fur[i].x = ENDIAN16(regions[i].x);
+        fur[i].y = ENDIAN16(regions[i].y);
+        fur[i].w = ENDIAN16(regions[i].w);
+        fur[i].h = ENDIAN16(regions[i].h);
+    }
+
+    if( unlikely(n && !rfb_write(vnc, fur, n * sz_rfbFramebufferUpdateRequestMsg)) )
+    {
+        vnc_log(vnc, VNC_LOG_ERROR, "request error.");
+        return 0;
+    }
+
+    vnc->outstanding++;
+    vnc->last_request = vnc_time_ns();
+    vnc_stats_request(vnc);
+    return 1;
+}
+
+// ask the server to push updates without being asked
+// the extension takes a single area, so cover all the regions of interest
+static int rfb_continuous_updates(vnc_t *vnc, uint8_t enable)
+{
+    rfbEnableContinuousUpdatesMsg ecu;
+    vnc_rect_t regions[VNC_MAX_ROI];
+    unsigned int i, n;
+
+    n = rfb_regions(vnc, regions);
+    for( i = 1; i < n; i++ )
+    {
+        vnc_rect_union(&regions[0], &regions[i]);
+    }
+    if( !n )
+    {
+        memset(&regions[0], 0, sizeof regions[0]);
+    }
+
+    ecu.type = rfbEnableContinuousUpdates;
+    ecu.enable = enable;
+    ecu.x = ENDIAN16(regions[0].x);
+    ecu.y = ENDIAN16(regions[0].y);
+    ecu.w = ENDIAN16(regions[0].w);
+    ecu.h = ENDIAN16(regions[0].h);
+
+    if( unlikely(!rfb_write(vnc, &ecu, sz_rfbEnableContinuousUpdatesMsg)) )
+    {
+        return 0;
+    }
+
+    vnc->continuous = enable;
+    return 1;
+}
+
+// the server changed the framebuffer size
+static int rfb_resize(vnc_t *vnc, unsigned int width, unsigned int height)
+{
+    if( !rfb_geometry_fits(vnc, width, height, vnc->server.pixelsize) )
+    {
+        return 0;
+    }
+
+    // a resize answers rfbSetScale
+    vnc->scale.sent = 0;
+    vnc->server.width = width;
+    vnc->server.height = height;
+    vnc->server.stride = vnc->server.width * vnc->server.pixelsize;
+    vnc->urq.w = ENDIAN16(vnc->server.width);
+    vnc->urq.h = ENDIAN16(vnc->server.height);
+    vnc->status.fbsize_updated = 1;
+
+    // update the screen on resize
+    vnc_clear(vnc);
+    vnc_set_screens(vnc, NULL, 0);
+    vnc_damage_all(vnc);
+
+    // pushed updates still cover the old size
+    if( vnc->continuous && !rfb_continuous_updates(vnc, 1) )
+    {
+        return 0;
+    }
+    vnc_log(vnc, VNC_LOG_INFO, "resize requested: %ux%u", width, height);
+
+    return 1;
+}
+
+// asks the server to send the framebuffer at 1/scale of its size
+// whether it did is only known once the first update arrives, see vnc_view
+static int rfb_set_scale(vnc_t *vnc)
+{
+    rfbSetScaleMsg ss;
+
+    vnc->scale.client = 0;
+    vnc->scale.sent = 0;
+    vnc->scale.orig_width = vnc->server.width;
+    vnc->scale.orig_height = vnc->server.height;
+
+    if( vnc->cfg.scale < 2 || vnc->scale.refused )
+    {
+        return 1;
+    }
+
+    ss.type = rfbSetScale;
+    ss.scale = (uint8_t)vnc->cfg.scale;
+    ss.pad = 0;
+    if( !rfb_write(vnc, &ss, sz_rfbSetScaleMsg) )
+    {
+        return 0;
+    }
+    vnc->scale.sent = 1;
+
+    return 1;
+}
+
+// a new size along with how the guest's monitors are laid out in it
+// the server sends one in answer to the first update request, and again on every change
+static int rfb_enc_ext_desktop_size(vnc_t *vnc, rfbFramebufferUpdateRectHeader rectheader)
+{
+    vnc_screen_t screens[VNC_MAX_SCREENS];
+    rfbExtDesktopSizeMsg eds;
+    rfbExtDesktopScreen s;
+    unsigned int i, n = 0;
+
+    if( unlikely(!rfb_read(vnc, &eds, sz_rfbExtDesktopSizeMsg)) )
+    {
+        return 0;
+    }
+
+    for( i = 0; i < eds.numberOfScreens; i++ )
+    {
+        if( unlikely(!rfb_read(vnc, &s, sz_rfbExtDesktopScreen)) )
+        {
+            return 0;
+        }
+        if( n < VNC_MAX_SCREENS )
+        {
+            screens[n].id = ENDIAN32(s.id);
+            screens[n].rect.x = ENDIAN16(s.x);
+            screens[n].rect.y = ENDIAN16(s.y);
+            screens[n].rect.w = ENDIAN16(s.width);
+            screens[n].rect.h = ENDIAN16(s.height);
+            n++;
+        }
+    }
+
+    // y is the result of a layout change some client asked for, nothing changed if it failed
+    if( rectheader.r.y )
+    {
+        return 1;
+    }
+
+    if( rectheader.r.w != vnc->server.width || rectheader.r.h != vnc->server.height )
+    {
+        if( !rfb_resize(vnc, rectheader.r.w, rectheader.r.h) )
+        {
+            return 0;
+        }
+    }
+
+    vnc_set_screens(vnc, screens, n);
+    vnc->status.fbsize_updated = 1;
+    vnc_log(vnc, VNC_LOG_DEBUG, "screen layout: %u of %u screens", vnc->status.num_screens, (unsigned int)eds.numberOfScreens);
+
+    return 1;
+}
+
+// limits capture to a few regions of the screen, or the whole screen if count is 0
+// call from the thread driving the connection; takes effect on the next tick
+int vnc_set_roi(vnc_t *vnc, const vnc_rect_t *rects, unsigned int count)
+{
+    if( count > VNC_MAX_ROI )
+    {
+        return 0;
+    }
+
+    if( count )
+    {
+        memcpy(vnc->roi, rects, count * sizeof *rects);
+    }
+    vnc->num_roi = count;
+    vnc->roi_changed = 1;
+
+    return 1;
+}
+
+// keep the request window full so the server always has one to answer
+// this hides the round trip between receiving an update and asking for the next
+// when the display is rate limited, requests are instead spaced out one at a time
+static int rfb_fill_requests(vnc_t *vnc)
+{
+    unsigned int window = vnc->cfg.window ? vnc->cfg.window : VNC_REQ_WINDOW;
+    uint64_t interval = vnc_request_interval(vnc);
+    uint64_t now;
+
+    // pushed updates can't be paced, so only use them while unlimited
+    if( vnc->continuous_supported && !vnc->cfg.disable_continuous )
+    {
+        if( !interval && !vnc->continuous )
+        {
+            return rfb_continuous_updates(vnc, 1);
+        }
+        if( interval && vnc->continuous )
+        {
+            if( unlikely(!rfb_continuous_updates(vnc, 0)) )
+            {
+                return 0;
+            }
+            rfb_forget_requests(vnc);
+        }
+    }
+
+    // the server is pushing updates on its own
+    if( vnc->continuous )
+    {
+        return 1;
+    }
+
+    if( interval )
+    {
+        now = vnc_time_ns();
+        if( vnc->outstanding || now < vnc->next_request )
+        {
+            return 1;
+        }
+        vnc->next_request = now + interval;
+        return rfb_request_frame(vnc, 1);
+    }
+
+    while( vnc->outstanding < window )
+    {
+        if( unlikely(!rfb_request_frame(vnc, 1)) )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// sends any update requests that are due
+// returns how many ms until it wants to run again, or -1 if the connection failed
+int rfb_tick(vnc_t *vnc)
+{
+    uint64_t timeout = VNC_REQ_TIMEOUT_MS * 1000000ULL;
+    uint64_t now = vnc_time_ns();
+    uint64_t wait = timeout;
+    uint64_t flush = 0;
+
+    // nothing came back for a while, so the server merged our requests
+    if( vnc->outstanding && now - vnc->last_request >= timeout )
+    {
+        rfb_forget_requests(vnc);
+    }
+
+    // newly selected regions have never been sent, so ask for all of them
+    if( unlikely(vnc->roi_changed) )
+    {
+        vnc->roi_changed = 0;
+        if( vnc->continuous && !rfb_continuous_updates(vnc, 1) )
+        {
+            return -1;
+        }
+        if( !rfb_request_frame(vnc, 0) )
+        {
+            return -1;
+        }
+    }
+
+    if( unlikely(!rfb_fill_requests(vnc)) )
+    {
+        return -1;
+    }
+
+    // data of a display that went quiet still reaches the disk in time
+    if( vnc->record )
+    {
+        flush = vnc_record_flush(vnc);
+    }
+
+    now = vnc_time_ns();
+    if( vnc->outstanding )
+    {
+        wait = vnc->last_request + timeout > now ? vnc->last_request + timeout - now : 0;
+    }
+    else if( !vnc->continuous && vnc->next_request > now )
+    {
+        wait = vnc->next_request - now;
+    }
+    if( flush && flush < wait )
+    {
+        wait = flush;
+    }
+
+    return (int)((wait + 999999) / 1000000);
+}
+
+// the server confirmed continuous updates, either supported or now stopped
+static int rfb_end_of_continuous_updates(vnc_t *vnc)
+{
+    if( !vnc->continuous_supported )
+    {
+        vnc_log(vnc, VNC_LOG_DEBUG, "server supports continuous updates.");
+        vnc->continuous_supported = 1;
+    }
+    else
+    {
+        // the server stopped pushing, go back to asking
+        vnc->continuous = 0;
+        rfb_forget_requests(vnc);
+    }
+
+    return rfb_fill_requests(vnc);
+}
+
+// answer fences from the server
+// because messages are decoded in order, the reply goes out only after everything
+// sent before it has been handled, so the server can pace itself on our decode rate
+static int rfb_fence_message(vnc_t *vnc, rfbServerToClientMsg *msg)
+{
+    uint8_t payload[rfbFenceMaxPayload];
+    rfbFenceMsg reply;
+    uint32_t flags;
+    uint8_t len;
+
+    if( !rfb_read(vnc, ((char*)&msg->f) + 1, sz_rfbFenceMsg - 1) )
+    {
+        return 0;
+    }
+
+    flags = ENDIAN32(msg->f.flags);
+    len = msg->f.length;
+
+    if( len > rfbFenceMaxPayload )
+    {
+        vnc_log(vnc, VNC_LOG_WARN, "fence payload too large.");
+        return 0;
+    }
+
+    if( len && !rfb_read(vnc, payload, len) )
+    {
+        return 0;
+    }
+
+    vnc->fence = 1;
+
+    if( !(flags & rfbFenceFlagRequest) )
+    {
+        return 1;
+    }
+
+    memset(&reply, 0, sizeof reply);
+    reply.type = rfbFence;
+    reply.flags = ENDIAN32(flags & rfbFenceFlagsSupported);
+    reply.length = len;
+
+    if( !rfb_write(vnc, &reply, sz_rfbFenceMsg) )
+    {
+        return 0;
+    }
+
+    return !len || rfb_write(vnc, payload, len);
+}
+
+// handles incomming messages from the vnc server
+// this is where the dma operations should take place
+// pass it a pointer and it will tell you if you need to
+// refresh the screen that is in the buffer
+static int rfb_handle_message(vnc_t *vnc)
+{
+    rfbFramebufferUpdateRectHeader rectheader;
+    rfbServerToClientMsg msg;
+    uint64_t start, now;
+    uint16_t i;
+    VNC_TRACE_VAR(trace_update)
+    VNC_TRACE_VAR(trace_rect)
+
+    if( unlikely(!rfb_read(vnc, &msg, 1)) )
+    {
+        return 0;
+    }
+
+    switch( msg.type )
+    {
+        case rfbFramebufferUpdate:
+            if( unlikely(!rfb_read(vnc, ((char*)&msg.fu) + 1, sz_rfbFramebufferUpdateMsg - 1)) )
+            {
+                return 0;
+            }
+            msg.fu.nRects = ENDIAN16(msg.fu.nRects);
+            start = vnc_time_ns();
+            VNC_TRACE_START(trace_update);
+            vnc_begin_write(vnc);
+
+            // ask for the next update before decoding this one
+            if( vnc->outstanding )
+            {
+                vnc->outstanding--;
+                vnc_stats_response(vnc, start);
+            }
+            if( unlikely(!rfb_fill_requests(vnc)) )
+            {
+                return 0;
+            }
+
+            // start a new damage list unless the last one hasn't been consumed yet
+            if( !vnc->status.updated )
+            {
+                vnc->status.num_damage = 0;
+            }
+            else
+            {
+                vnc_count(&vnc->stats.dropped, 1);
+            }
+
+            for( i = 0; i < msg.fu.nRects; i++ )
+            {
+                int result = 0;
+                VNC_TRACE_START(trace_rect);
+                if( unlikely(!rfb_read(vnc, &rectheader, sz_rfbFramebufferUpdateRectHeader)) )
+                {
+                    return 0;
+                }
+
+                // the server kept talking after rfbSetScale, so it didn't refuse it
+                vnc->scale.sent = 0;
+
+                rectheader.r.x = ENDIAN16(rectheader.r.x);
+                rectheader.r.y = ENDIAN16(rectheader.r.y);
+                rectheader.r.w = ENDIAN16(rectheader.r.w);
+                rectheader.r.h = ENDIAN16(rectheader.r.h);
+
+                switch( ENDIAN32(rectheader.encoding) )
+                {
+                    case rfbEncodingRaw:
+                        vnc_count(&vnc->stats.rects[VNC_STAT_RAW], 1);
+                        vnc_count(&vnc->stats.pixels, (uint64_t)rectheader.r.w * rectheader.r.h);
+                        result = rfb_enc_raw(vnc, rectheader);
+                        VNC_TRACE_SPAN("raw", trace_rect);
+                        vnc_add_damage(vnc, rectheader.r.x, rectheader.r.y, rectheader.r.w, rectheader.r.h);
+                        break;
+                    case rfbEncodingCopyRect:
+                        vnc_count(&vnc->stats.rects[VNC_STAT_COPYRECT], 1);
+                        vnc_count(&vnc->stats.pixels, (uint64_t)rectheader.r.w * rectheader.r.h);
+                        result = rfb_enc_copyrect(vnc, rectheader);
+                        VNC_TRACE_SPAN("copyrect", trace_rect);
+                        vnc_add_damage(vnc, rectheader.r.x, rectheader.r.y, rectheader.r.w, rectheader.r.h);
+                        break;
+                    case rfbEncodingNewFBSize:
+                        vnc_count(&vnc->stats.rects[VNC_STAT_NEWFBSIZE], 1);
+                        result = rfb_resize(vnc, rectheader.r.w, rectheader.r.h);
+                        VNC_TRACE_SPAN("newfbsize", trace_rect);
+                        break;
+                    case rfbEncodingExtDesktopSize:
+                        vnc_count(&vnc->stats.rects[VNC_STAT_NEWFBSIZE], 1);
+                        result = rfb_enc_ext_desktop_size(vnc, rectheader);
+                        VNC_TRACE_SPAN("extdesktopsize", trace_rect);
+                        break;
+                    case rfbEncodingRichCursor:
+                        vnc_count(&vnc->stats.rects[VNC_STAT_CURSOR], 1);
+                        result = rfb_enc_rich_cursor(vnc, rectheader);
+                        VNC_TRACE_SPAN("richcursor", trace_rect);
+                        break;
+                    case rfbEncodingXCursor:
+                        vnc_count(&vnc->stats.rects[VNC_STAT_CURSOR], 1);
+                        result = rfb_enc_xcursor(vnc, rectheader);
+                        VNC_TRACE_SPAN("xcursor", trace_rect);
+                        break;
+                    case rfbEncodingPointerPos:
+                        // the pointer moved, which costs nothing in the framebuffer
+                        vnc_count(&vnc->stats.rects[VNC_STAT_CURSOR], 1);
+                        vnc->cursor.x = rectheader.r.x;
+                        vnc->cursor.y = rectheader.r.y;
+                        vnc->cursor.updated = 1;
+                        result = 1;
+                        break;
+                    case rfbEncodingLastRect:
+                        result = 1;
+                        break;
+                    default:
+                        vnc_count(&vnc->stats.rects[VNC_STAT_OTHER], 1);
+                        vnc_log(vnc, VNC_LOG_WARN, "unknown encoding: %d", (int)ENDIAN32(rectheader.encoding));
+                        break;
+                }
+
+                if( !result )
+                {
+                    vnc_log(vnc, VNC_LOG_ERROR, "encoding failed.");
+                    return 0;
+                }
+            }
+
+            // inform the user of the updated rectangles
+            // this prevents copying of the entire buffer, and instead just the damaged regions
+            vnc_commit_damage(vnc);
+            VNC_TRACE_SPAN("update", trace_update);
+
+            now = vnc_time_ns();
+            vnc_count(&vnc->stats.updates, 1);
+            vnc_hist_add(&vnc->stats.decode_time, now - start);
+            if( !vnc->stats.decoded )
+            {
+                vnc->stats.decoded = now;
+            }
+
+            // replayed streams have no connection to time
+            if( unlikely(!vnc->first_frame_time && !vnc->replay) )
+            {
+                vnc->first_frame_time = vnc_time_ns() - vnc->connect_time;
+                vnc_log(vnc, VNC_LOG_INFO, "first frame after %.3f ms.", vnc->first_frame_time / 1e6);
+            }
+            break;
+        case rfbResizeFrameBuffer:
+            // the answer to rfbSetScale
+            if( !rfb_read(vnc, ((char*)&msg.rsfb) + 1, sz_rfbResizeFrameBufferMsg - 1) ||
+                !rfb_resize(vnc, ENDIAN16(msg.rsfb.framebufferWidth), ENDIAN16(msg.rsfb.framebufferHeigth)) )
+            {
+                return 0;
+            }
+            break;
+        case rfbPalmVNCReSizeFrameBuffer:
+            if( !rfb_read(vnc, ((char*)&msg.prsfb) + 1, sz_rfbPalmVNCReSizeFrameBufferMsg - 1) ||
+                !rfb_resize(vnc, ENDIAN16(msg.prsfb.buffer_w), ENDIAN16(msg.prsfb.buffer_h)) )
+            {
+                return 0;
+            }
+            break;
+        case rfbSetColourMapEntries:
+            rfb_read(vnc, ((char*)&msg.scme) + 1, sz_rfbSetColourMapEntriesMsg - 1);
+            break;
+        case rfbBell:
+            break;
+        case rfbServerCutText:
+            if( !rfb_cut_text_message(vnc, &msg) )
+            {
+                return 0;
+            }
+            break;
+        case rfbEndOfContinuousUpdates:
+            if( !rfb_end_of_continuous_updates(vnc) )
+            {
+                return 0;
+            }
+            break;
+        case rfbFence:
+            if( !rfb_fence_message(vnc, &msg) )
+            {
+                return 0;
+            }
+            break;
+        default:
+            vnc_log(vnc, VNC_LOG_ERROR, "unknown message type: %u", msg.type);
+            return 0;
+    }
+    return 1;
+}
+
+// handles one message once the socket is readable
+// for callers running their own event loop, returns 0 if the connection was lost
+int rfb_process(vnc_t *vnc)
+{
+    ssize_t connected;
+    uint32_t buf;
+    int ok;
+
+    // check if the server disconnected
+    connected = recv(vnc->sock, &buf, sizeof buf, MSG_PEEK | MSG_DONTWAIT);
+    if( unlikely(connected == 0) )
+    {
+        rfb_disconnect(vnc);
+        return 0;
+    }
+
+    // check for frames
+    if( unlikely(vnc->record != NULL) )
+    {
+        vnc_record_begin(vnc);
+    }
+    ok = rfb_handle_message(vnc);
+    if( unlikely(vnc->record != NULL) )
+    {
+        vnc_record_end(vnc, ok);
+    }
+    if( unlikely(!ok) )
+    {
+        rfb_disconnect(vnc);
+        return 0;
+    }
+
+    return 1;
+}
+
+// decodes every message of a server to client stream held in memory, as if it came from the socket
+// returns 0 if a message is malformed or cut short
+int rfb_replay(vnc_t *vnc, const uint8_t *data, size_t len)
+{
+    int result = 1;
+
+    vnc->replay = data;
+    vnc->replay_len = len;
+    vnc->replay_pos = 0;
+
+    while( vnc->replay_pos < vnc->replay_len )
+    {
+        if( unlikely(!rfb_handle_message(vnc)) )
+        {
+            result = 0;
+            break;
+        }
+    }
+
+    vnc->replay = NULL;
+
+    return result;
+}
+
+int rfb_grab(vnc_t *vnc, int update)
+{
+    struct pollfd pfd;
+    int timeout;
+    int ready;
+
+    // send whatever requests are due, and wait no longer than the next one
+    timeout = rfb_tick(vnc);
+    if( unlikely(timeout < 0) )
+    {
+        rfb_disconnect(vnc);
+        return 0;
+    }
+
+    pfd.fd = vnc->sock;
+    pfd.events = POLLIN;
+    ready = poll(&pfd, 1, timeout);
+    if( unlikely(ready <= 0) )
+    {
+        if( ready < 0 && errno != EINTR )
+        {
+            rfb_disconnect(vnc);
+            return 0;
+        }
+        return 1;
+    }
+
+    if( unlikely(!rfb_process(vnc)) )
+    {
+        return 0;
+    }
+
+    // this is only for requesting a full frame update
+    if( unlikely(update) )
+    {
+        if( unlikely(!rfb_request_frame(vnc, 0)) )
+        {
+            rfb_disconnect(vnc);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// limits how long each read may block, 0 blocks for as long as it takes
+static int rfb_set_timeout(vnc_t *vnc, unsigned int ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    return setsockopt(vnc->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) == 0;
+}
+
+// connects the socket and runs the handshake
+static int rfb_connect_link(vnc_t *vnc, const char *path, uint16_t port)
+{
+    VNC_TRACE_VAR(trace_stage)
+
+    VNC_TRACE_START(trace_stage);
+
+    // if port is used, assume tcp
+    if (port) {
+        struct sockaddr_in serv_addr;
+
+        if( (vnc->sock = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+        {
+            vnc_log(vnc, VNC_LOG_ERROR, "socket error.");
+            return 0;
+        }
+        memset(&serv_addr, '0', sizeof(serv_addr));
+
+        serv_addr.sin_family = AF_INET;
+        serv_addr.sin_port = htons(port);
+
+        if( inet_pton(AF_INET, path, &serv_addr.sin_addr) <= 0 )
+        {
+            vnc_log(vnc, VNC_LOG_ERROR, "invalid address.");
+            close(vnc->sock);
+            return 0;
+        }
+
+        // actually try to connect
         if( connect(vnc->sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0 )
         {
+            close(vnc->sock);
             return 2;
         }
     }
     else
     {
         struct sockaddr_un serv_addr;
-        struct stat sb;
 
         //fprintf(stdout, "attempting to connect to \'%s\'\n", path);
 
-        while( stat(path, &sb) == -1 || (sb.st_mode & S_IFMT) != S_IFSOCK )
-        {
-            return 2;
-        }
-
         if( (vnc->sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
         {
-            fprintf(stdout, "socket error.\n");
+            vnc_log(vnc, VNC_LOG_ERROR, "socket error.");
             return 0;
         }
 
@@ -653,65 +1799,155 @@ int rfb_connect(vnc_t *vnc, const char *path, uint16_t port)
 
         if( (connect(vnc->sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) )
         {
+            close(vnc->sock);
             return 2;
         }
         //fprintf(stdout, "connected.\n");
     }
 
+    VNC_TRACE_SPAN("connect", trace_stage);
+
+    // from here on failures are the server's, a vm rebooting or still starting, so they are retried
+
+    // the handshake holds a scheduler slot, a server that stalls in it must give that back
+    if( !rfb_set_timeout(vnc, VNC_HANDSHAKE_TIMEOUT_MS) )
+    {
+        vnc_log(vnc, VNC_LOG_ERROR, "socket timeout error.");
+        close(vnc->sock);
+        return 2;
+    }
+
+    vnc->connect_time = vnc_time_ns();
+    vnc->first_frame_time = 0;
+    vnc->scale.sent = 0;
+    vnc->continuous = 0;
+    vnc->continuous_supported = 0;
+    vnc->fence = 0;
+    vnc->next_request = 0;
+    vnc->roi_changed = 0;
+
     // next, attempt to link to rfb
-    fprintf(stdout, "connected to %s @ %u.\n", vnc->cfg.socket, vnc->cfg.port);
-    fprintf(stdout, "attempting to negotiate link.\n");
+    vnc_log(vnc, VNC_LOG_DEBUG, "connected to %s @ %u, negotiating link.", vnc->cfg.socket, vnc->cfg.port);
     if( !rfb_negotiate_link(vnc) )
     {
-        fprintf(stdout, "negotiate error.");
+        vnc_log(vnc, VNC_LOG_ERROR, "negotiate error.");
         rfb_disconnect(vnc);
-        return 0;
+        return 2;
     }
+    VNC_TRACE_SPAN("negotiate", trace_stage);
     if( !rfb_authenticate_link(vnc) )
     {
-        fprintf(stdout, "authenticate error.");
+        vnc_log(vnc, VNC_LOG_ERROR, "authenticate error.");
         rfb_disconnect(vnc);
-        return 0;
+        return 2;
     }
+    VNC_TRACE_SPAN("authenticate", trace_stage);
     if( !rfb_initialize_server(vnc) )
     {
-        fprintf(stdout, "server error.");
+        vnc_log(vnc, VNC_LOG_ERROR, "server error.");
         rfb_disconnect(vnc);
-        return 0;
+        return 2;
     }
+    VNC_TRACE_SPAN("server init", trace_stage);
     if( !rfb_negotiate_frame_format(vnc) )
     {
-        fprintf(stdout, "frame format error.");
+        vnc_log(vnc, VNC_LOG_ERROR, "frame format error.");
         rfb_disconnect(vnc);
-        return 0;
+        return 2;
+    }
+    VNC_TRACE_SPAN("set encodings", trace_stage);
+    if( !rfb_set_scale(vnc) )
+    {
+        vnc_log(vnc, VNC_LOG_ERROR, "set scale error.");
+        rfb_disconnect(vnc);
+        return 2;
     }
 
-    fprintf(stdout, "successfully connected to vnc server.\n");
+    vnc->handshake_time = vnc_time_ns() - vnc->connect_time;
+    vnc_log(vnc, VNC_LOG_INFO, "connected to %s @ %u in %.3f ms.", vnc->cfg.socket, vnc->cfg.port, vnc->handshake_time / 1e6);
 
-    // just wait for data, not needed but it makes me feel better
-    sleep(1);
+    // request the first frame right away, reads block until the server answers
+    // then queue up incremental requests behind it
+    rfb_forget_requests(vnc);
+    if( !rfb_request_frame(vnc, 0) || !rfb_fill_requests(vnc) || !rfb_set_timeout(vnc, 0) )
+    {
+        rfb_disconnect(vnc);
+        return 2;
+    }
+    VNC_TRACE_SPAN("request", trace_stage);
 
-    // request the first frame
-    rfb_request_frame(vnc, 0);
+    // nothing from the last connection should show before the first frame
+    vnc_clear(vnc);
+    vnc_set_screens(vnc, NULL, 0);
 
     // inform the drawer to set the new size
     vnc->status.fbsize_updated = 1;
     vnc->status.updated = 0;
-
-    fflush(stdout);
-    fflush(stderr);
+    vnc->status.off = 0;
 
     return 1;
 }
 
+// connects to the hosted socket addresses
+// returns 0 if fatal error, 1 if success, and 2 if retry is needed
+int rfb_connect(vnc_t *vnc, const char *path, uint16_t port)
+{
+    int value;
+
+    vnc->cfg.socket = path;
+    vnc->cfg.port = port;
+
+    // nothing to do until the vm creates its socket, so don't take a handshake slot
+    if( !port && !vnc_socket_exists(path) )
+    {
+        return 2;
+    }
+
+    vnc_sched_acquire(vnc);
+    value = rfb_connect_link(vnc, path, port);
+    vnc_sched_release(vnc);
+    if( value != 1 )
+    {
+        vnc_count(&vnc->stats.failures, 1);
+    }
+
+    if( value == 1 )
+    {
+        vnc_count(&vnc->stats.connects, 1);
+        vnc_backoff_reset(vnc);
+        vnc_governor_join(vnc);
+
+        // a recording that can't be opened shouldn't stop the capture
+        if( vnc->cfg.record && !vnc->record )
+        {
+            __atomic_store_n(&vnc->record, vnc_record_open(vnc->cfg.record, vnc->cfg.uuid, vnc->cfg.record_keyframe_ms), __ATOMIC_RELEASE);
+        }
+    }
+
+    return value;
+}
+
 // helper function for updating the screen
 // implement however you please
 void update_screen(vnc_t *vnc)
 {
+    VNC_TRACE_VAR(trace_publish)
+
+    if( vnc->status.updated )
+    {
+        vnc_stats_published(vnc);
+    }
+    if( vnc->cfg.publish )
+    {
+        VNC_TRACE_START(trace_publish);
+        vnc->cfg.publish(vnc);
+        VNC_TRACE_SPAN("publish", trace_publish);
+        return;
+    }
     if( unlikely(vnc->status.fbsize_updated) )
     {
         vnc->status.fbsize_updated = 0;
-        fprintf(stdout, "applied to %s @ %u\n", vnc->cfg.socket, vnc->cfg.port);
+        vnc_log(vnc, VNC_LOG_DEBUG, "applied to %s @ %u", vnc->cfg.socket, vnc->cfg.port);
         // wipe the image that was previously there and set the new video stream config
         // centering would probably look the best
     }
@@ -724,42 +1960,85 @@ void update_screen(vnc_t *vnc)
 }
 
 // helper for launching multiple vnc viewers at once
-// it returns only in the event of a critical error
+// it returns in the event of a critical error, or once vnc->stop is set
+// stopping ends the connection and writes out the recording before returning
 void *vnc_thread(void *state)
 {
     vnc_t *vnc = state;
+    unsigned int delay, slice;
+    int connected = 0;
+    int stale;
     int value;
 
-    while( 1 )
+    VNC_TRACE_THREAD(vnc->cfg.uuid);
+
+    while( !vnc_stopping(vnc) )
     {
         vnc_vm_off(vnc);
+        update_screen(vnc);
 
-        while( 1 )
+        while( !vnc_stopping(vnc) )
         {
             value = rfb_connect(vnc, vnc->cfg.socket, vnc->cfg.port);
             if( value == 0 )
             {
+                vnc_log(vnc, VNC_LOG_ERROR, "can't connect to %s @ %u, giving up on this display.", vnc->cfg.socket, vnc->cfg.port);
                 return (void*)1;
             }
             if( value == 1 )
             {
+                connected = 1;
                 break;
             }
             if( value == 2 )
             {
                 //fprintf(stdout, "retry %s @ %u\n", vnc->cfg.socket, vnc->cfg.port);
-                sleep(2);
+                delay = vnc_backoff_next(vnc);
+
+                // wake as soon as a missing unix socket is created
+                // if it exists but refused us it is left over from a dead vm, so wait for it to be replaced
+                // the wait is cut into slices so a stop request doesn't sit out the whole backoff
+                stale = !vnc->cfg.port && vnc_socket_exists(vnc->cfg.socket);
+                while( delay && !vnc_stopping(vnc) )
+                {
+                    slice = delay < VNC_STOP_POLL_MS ? delay : VNC_STOP_POLL_MS;
+                    if( vnc->cfg.port )
+                    {
+                        vnc_sleep_ms(slice);
+                    }
+                    else if( vnc_watch_wait(vnc->cfg.socket, stale, slice) )
+                    {
+                        break;
+                    }
+                    delay -= slice;
+                }
             }
         }
 
-        while( 1 )
+        while( connected )
         {
             if( unlikely(!rfb_grab(vnc, 0)) )
             {
+                connected = 0;
                 break;
             }
             update_screen(vnc);
+            if( vnc_stopping(vnc) )
+            {
+                rfb_disconnect(vnc);
+                connected = 0;
+            }
         }
     }
+
+    // the writer drains whatever is queued before this returns
+    if( vnc->record )
+    {
+        vnc_record_t *rec = vnc->record;
+
+        __atomic_store_n(&vnc->record, NULL, __ATOMIC_RELEASE);
+        vnc_record_close(rec);
+    }
+
     return (void*)0;
 }
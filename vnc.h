@@ -20,9 +20,73 @@ extern "C" {
 #define VNC_DEACTIVE_IMG_Y (((VNC_DEACTIVE_VRES) / 2) - ((VNC_DEACTIVE_IMG_VRES) / 2))
 #define VNC_BUF_SIZE (4096 * 2160 * 4)
 
-// never write to this, so no mutex needed
-extern const unsigned char vm_off_bin[];
+// most regions of interest a display can be limited to
+#define VNC_MAX_ROI 8
 
+// incremental update requests kept in flight by default
+// and how long to wait on a quiet server before assuming it merged them
+#define VNC_REQ_WINDOW 2
+#define VNC_REQ_TIMEOUT_MS 1000
+
+// longest a server may keep any handshake read waiting, so a stalled vm can't hold a handshake slot
+#define VNC_HANDSHAKE_TIMEOUT_MS 5000
+
+// longest vnc_thread waits to retry before checking whether it was asked to stop
+#define VNC_STOP_POLL_MS 1000
+
+// bounds on the randomized wait between connection attempts
+#define VNC_BACKOFF_MIN_MS 50
+#define VNC_BACKOFF_MAX_MS 16000
+
+// number of damage rectangles tracked before collapsing to a bounding box
+#define VNC_MAX_DAMAGE 64
+
+// guest monitors kept from a screen layout, any beyond are ignored
+#define VNC_MAX_SCREENS 16
+
+// largest cursor shape kept, bigger ones are skipped and leave no cursor
+#define VNC_CURSOR_MAX 128
+
+// largest downscale a display can ask for, rfbSetScale carries it in a byte
+#define VNC_SCALE_MAX 16
+
+// session recordings are handed to the writer in buffers of this size
+// and a display that falls further behind than the queue limit drops data until its next keyframe
+#define VNC_REC_BUF_SIZE (4 * 1024 * 1024)
+#define VNC_REC_MAX_QUEUED (64 * 1024 * 1024)
+#define VNC_REC_FLUSH_MS 250
+#define VNC_REC_KEYFRAME_MS 10000
+
+// latency histograms keep 1/16 precision over the whole range of ns values, like hdr histograms
+#define VNC_HIST_SUB_BITS 4
+#define VNC_HIST_SUB (1 << VNC_HIST_SUB_BITS)
+#define VNC_HIST_BUCKETS ((64 - VNC_HIST_SUB_BITS + 1) * VNC_HIST_SUB)
+
+// send times kept for measuring request latency, more requests in flight than this go unmeasured
+#define VNC_STAT_REQUESTS 16
+
+// logging goes through a queue of this many lines, each at most VNC_LOG_LINE long
+// a display may log VNC_LOG_RATE lines per second after a burst of VNC_LOG_BURST
+#define VNC_LOG_SLOTS 1024
+#define VNC_LOG_LINE 256
+#define VNC_LOG_RATE 10
+#define VNC_LOG_BURST 20
+#define VNC_LOG_FLUSH_MS 1000
+
+enum
+{
+    VNC_LOG_ERROR = 0,
+    VNC_LOG_WARN,
+    VNC_LOG_INFO,
+    VNC_LOG_DEBUG
+};
+
+// the compressed "vm off" image, see vnc_off_image()
+extern const unsigned char vm_off_rle[];
+extern const unsigned int vm_off_rle_len;
+
+#include <stddef.h>
+#include <stdio.h>
 #include <stdint.h>
 
 #ifdef WORDS_BIGENDIAN
@@ -62,26 +126,180 @@ typedef struct
 }
 server_t;
 
+typedef struct
+{
+    unsigned int x;
+    unsigned int y;
+    unsigned int w;
+    unsigned int h;
+}
+vnc_rect_t;
+
+// one guest monitor, an area of the framebuffer
+typedef struct
+{
+    uint32_t id;
+    vnc_rect_t rect;
+}
+vnc_screen_t;
+
 typedef struct
 {
     int updated;
     int fbsize_updated;
+    int off;                     // showing the vm off placeholder
     unsigned int update_offset;  // offset into data to start updating
     unsigned int update_size;    // size of data to update
+    unsigned int num_damage;     // number of valid rectangles in damage
+    vnc_rect_t damage[VNC_MAX_DAMAGE]; // regions changed since the last time updated was cleared
+    unsigned int num_screens;    // guest monitors, a single one covering the framebuffer without a layout
+    vnc_screen_t screens[VNC_MAX_SCREENS]; // changes are announced with fbsize_updated
 }
 scrn_status_t;
 
+// the pointer as the server reports it, kept apart from the framebuffer
+// consumers that want the cursor in their frames draw it themselves with vnc_cursor_draw
+typedef struct
+{
+    unsigned int x;              // pointer position in the framebuffer
+    unsigned int y;
+    unsigned int hotx;           // hotspot, the point of the image at the pointer position
+    unsigned int hoty;
+    unsigned int width;          // 0 while there is no shape to draw
+    unsigned int height;
+    uint8_t pixels[VNC_CURSOR_MAX * VNC_CURSOR_MAX * 4]; // framebuffer format, rows packed
+    uint8_t mask[VNC_CURSOR_MAX * VNC_CURSOR_MAX]; // 0xff where the image is opaque
+    uint32_t serial;             // counts up with every new shape
+    int updated;                 // moved or changed since the last time this was cleared
+}
+vnc_cursor_t;
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[VNC_HIST_BUCKETS];
+}
+vnc_hist_t;
+
+typedef enum
+{
+    VNC_STAT_RAW = 0,
+    VNC_STAT_COPYRECT,
+    VNC_STAT_NEWFBSIZE,
+    VNC_STAT_CURSOR,
+    VNC_STAT_OTHER,
+    VNC_STAT_ENCODINGS
+}
+vnc_stat_encoding_t;
+
+// written only by the thread running the display, so other threads can read it without locks
+typedef struct
+{
+    uint64_t bytes;              // read from the socket, handshakes included
+    uint64_t updates;            // framebuffer updates decoded
+    uint64_t rects[VNC_STAT_ENCODINGS]; // rectangles decoded per encoding
+    uint64_t pixels;             // pixels written by raw and copyrect rectangles
+    uint64_t frames;             // updates handed to a consumer
+    uint64_t dropped;            // updates merged into one the consumer hadn't taken yet
+    uint64_t connects;           // successful connections, all but the first are reconnects
+    uint64_t failures;           // connections that failed during the handshake
+    vnc_hist_t request_latency;  // ns from sending an update request to its update arriving
+    vnc_hist_t decode_time;      // ns spent decoding one update
+    vnc_hist_t publish_latency;  // ns from an update being decoded to a consumer taking it
+    uint64_t decoded;            // when the oldest update not yet taken finished decoding
+    uint64_t requests[VNC_STAT_REQUESTS]; // send times of requests in flight, oldest first
+    unsigned int first_request;
+    unsigned int num_requests;
+}
+vnc_stats_t;
+
+// downscaled frames for consumers that only want thumbnails, see scale.c
+// the server is asked to scale with rfbSetScale, whatever it leaves undone is done here
+typedef struct
+{
+    unsigned int client;         // factor left to apply here, 0 until the first update shows what the server did
+    int sent;                    // rfbSetScale went out on this connection and nothing has come back since, see rfb_disconnect
+    int refused;                 // the server dropped a connection over rfbSetScale, don't ask again
+    unsigned int orig_width;     // size before the server scaled
+    unsigned int orig_height;
+    uint8_t *pixels;             // scaled copy, the user buffer when there is one
+    size_t size;                 // bytes allocated for pixels when it isn't the user buffer
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    unsigned int num_damage;     // damage and screens of the last view, in scaled coordinates
+    vnc_rect_t damage[VNC_MAX_DAMAGE];
+    vnc_screen_t screens[VNC_MAX_SCREENS];
+}
+vnc_scale_t;
+
+// halved copies of the shown frame for thumbnails, 1/2, 1/4 and 1/8 of its size, see scale.c
+#define VNC_MIP_LEVELS 3
+
+typedef struct
+{
+    uint8_t *pixels;
+    size_t size;                 // bytes allocated for pixels
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+}
+vnc_mip_level_t;
+
+typedef struct
+{
+    vnc_mip_level_t level[VNC_MIP_LEVELS]; // level[0] is half size
+    unsigned int levels;         // levels kept up to date from damage, deeper ones are built whole when asked for
+    unsigned int width;          // frame the levels were built from, a change rebuilds them
+    unsigned int height;
+    unsigned int pixelsize;
+    int off;
+}
+vnc_mip_t;
+
+// a frame as consumers see it
+typedef struct
+{
+    const uint8_t *pixels;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    unsigned int pixelsize;
+    unsigned int num_damage;
+    const vnc_rect_t *damage;
+    unsigned int num_screens;
+    const vnc_screen_t *screens;
+}
+vnc_view_t;
+
+struct vnc;
+typedef struct vnc_record vnc_record_t;
+typedef struct vnc_replay vnc_replay_t;
+
 typedef struct
 {
     const char *uuid;            // used for identifying the display
     const char *socket;
     uint16_t port;
-    void *buffer;                // allocated or remapped region
+    void *buffer;                // allocated or remapped region, at least VNC_BUF_SIZE
     int use_buffer;              // use user buffer instead
+    void (*publish)(struct vnc *vnc); // called by vnc_thread after updates, instead of update_screen
+    void (*begin_write)(struct vnc *vnc); // called before pixels in the user buffer change, publish ends the write
+    void *user;                  // owned by whoever set publish
+    unsigned int window;         // update requests kept in flight, 0 for VNC_REQ_WINDOW
+    int disable_continuous;      // never let the server push updates unrequested
+    int disable_cursor;          // leave the cursor in the framebuffer, drawn by the server
+    unsigned int scale;          // hand out frames at 1/scale of the server's size, 0 or 1 for full size
+    unsigned int fps;            // target update rate, 0 for as fast as the server goes
+    unsigned int idle_fps;       // update rate while no consumers are attached, 0 to keep fps
+    const char *record;          // append the session to this file, NULL to not record
+    unsigned int record_keyframe_ms; // time between keyframes, 0 for VNC_REC_KEYFRAME_MS
 }
 vnc_thread_cfg_t;
 
-typedef struct
+typedef struct vnc
 {
     char *path;
     int sock;                    // connected socket for xfer
@@ -90,15 +308,136 @@ typedef struct
     uint8_t buf[VNC_BUF_SIZE];   // buffer for storing pixel data
     rfbFramebufferUpdateRequestMsg urq;
     scrn_status_t status;
+    vnc_cursor_t cursor;
+    vnc_scale_t scale;
+    vnc_mip_t mip;
     vnc_thread_cfg_t cfg;
+    uint64_t connect_time;       // monotonic time the socket connected, in ns
+    uint64_t handshake_time;     // ns spent negotiating the last connection
+    uint64_t first_frame_time;   // ns from connecting to the first complete update, 0 until it arrives
+    unsigned int attempts;       // failed connection attempts since the last success
+    unsigned int seed;           // jitter state for retries
+    int consumers;               // attached consumers, these displays reconnect first
+    unsigned int outstanding;    // update requests sent but not yet answered
+    int continuous;              // server pushes updates without requests
+    int continuous_supported;    // server can push updates
+    int fence;                   // server uses fences for flow control
+    uint64_t last_request;       // time the last update request went out
+    uint64_t next_request;       // earliest time a paced update request may go out
+    int governed;                // counted towards the global update rate budget
+    vnc_rect_t roi[VNC_MAX_ROI]; // regions to capture, in framebuffer coordinates
+    unsigned int num_roi;        // 0 captures the whole screen
+    int roi_changed;             // regions changed, so they need a full refresh
+    const uint8_t *replay;       // messages are decoded from here instead of the socket when set
+    size_t replay_len;
+    size_t replay_pos;
+    vnc_record_t *record;        // open recording, messages read from the socket are copied here
+    int stop;                    // set from another thread to make vnc_thread return
+    vnc_stats_t stats;
+    uint64_t log_time;           // rate limiting of this display's log lines
+    uint64_t log_credit;
+    unsigned int log_suppressed;
 }
 vnc_t;
 
+// where pixels are decoded to, either the built in buffer or the user's
+// a scaled display decodes into the built in buffer and scales into the user's
+static inline uint8_t *vnc_framebuffer(vnc_t *vnc)
+{
+    return vnc->cfg.use_buffer && vnc->cfg.scale < 2 ? (uint8_t *)vnc->cfg.buffer : vnc->buf;
+}
+
+const uint8_t *vnc_off_image(void);
+
+// lets the owner of a shared user buffer mark it as being written, see vncxferd.h
+static inline void vnc_begin_write(vnc_t *vnc)
+{
+    if( vnc->cfg.begin_write )
+    {
+        vnc->cfg.begin_write(vnc);
+    }
+}
+
+// what should be shown, the off screen is shared rather than drawn into every buffer
+static inline const uint8_t *vnc_pixels(vnc_t *vnc)
+{
+    return vnc->status.off ? vnc_off_image() : vnc_framebuffer(vnc);
+}
+
 void *vnc_thread(void *config);
+
+static inline int vnc_stopping(vnc_t *vnc)
+{
+    return __atomic_load_n(&vnc->stop, __ATOMIC_ACQUIRE);
+}
+void update_screen(vnc_t *vnc);
 void vnc_vm_off(vnc_t *vnc);
+void vnc_cursor_draw(vnc_t *vnc, uint8_t *dst, unsigned int stride, unsigned int width, unsigned int height);
+size_t rfb_cursor_message(vnc_t *vnc, uint8_t *out);
+void vnc_view(vnc_t *vnc, vnc_view_t *view);
+const vnc_mip_level_t *vnc_mip(vnc_t *vnc, unsigned int level);
+void vnc_scale_free(vnc_t *vnc);
+void vnc_set_screens(vnc_t *vnc, const vnc_screen_t *screens, unsigned int count);
+int vnc_load_frame(vnc_t *vnc, unsigned int width, unsigned int height, unsigned int pixelsize, const uint8_t *pixels);
 int rfb_connect(vnc_t *vnc, const char *socket, uint16_t port);
 int rfb_grab(vnc_t *vnc, int update);
+int rfb_process(vnc_t *vnc);
 int rfb_disconnect(vnc_t *vnc);
+int rfb_tick(vnc_t *vnc);
+int rfb_replay(vnc_t *vnc, const uint8_t *data, size_t len);
+int vnc_set_roi(vnc_t *vnc, const vnc_rect_t *rects, unsigned int count);
+
+vnc_record_t *vnc_record_open(const char *path, const char *uuid, unsigned int keyframe_ms);
+void vnc_record_close(vnc_record_t *rec);
+void vnc_record_begin(vnc_t *vnc);
+void vnc_record_data(vnc_record_t *rec, const void *data, size_t len);
+void vnc_record_end(vnc_t *vnc, int ok);
+uint64_t vnc_record_flush(vnc_t *vnc);
+void vnc_record_disconnect(vnc_t *vnc);
+void vnc_record_usage(vnc_record_t *rec, uint64_t *queued, uint64_t *dropped);
+
+vnc_replay_t *vnc_replay_open(const char *path);
+void vnc_replay_close(vnc_replay_t *r);
+void vnc_replay_span(vnc_replay_t *r, uint64_t *first, uint64_t *last);
+int vnc_replay_step(vnc_replay_t *r, vnc_t *vnc, uint64_t *time);
+int vnc_replay_seek(vnc_replay_t *r, vnc_t *vnc, uint64_t time);
+
+uint64_t vnc_time_ns(void);
+int vnc_socket_exists(const char *path);
+int vnc_watch_wait(const char *path, int stale, unsigned int timeout_ms);
+
+// counters have a single writer, relaxed stores keep readers on other threads from tearing them
+static inline void vnc_count(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void vnc_hist_add(vnc_hist_t *h, uint64_t value);
+uint64_t vnc_hist_percentile(const vnc_hist_t *h, double percentile);
+void vnc_stats_request(vnc_t *vnc);
+void vnc_stats_response(vnc_t *vnc, uint64_t now);
+void vnc_stats_published(vnc_t *vnc);
+int vnc_stats_text(vnc_t *vnc, char *buf, size_t len);
+int vnc_stats_prometheus(FILE *out, vnc_t *const *vncs, unsigned int count);
+
+void vnc_log(vnc_t *vnc, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void vnc_log_level(int level);
+void vnc_log_flush(void);
+
+void vnc_sleep_ms(unsigned int ms);
+void vnc_sched_init(unsigned int max_handshakes);
+void vnc_sched_acquire(vnc_t *vnc);
+void vnc_sched_release(vnc_t *vnc);
+unsigned int vnc_sched_active(void);
+unsigned int vnc_backoff_next(vnc_t *vnc);
+void vnc_backoff_reset(vnc_t *vnc);
+void vnc_attach(vnc_t *vnc);
+void vnc_detach(vnc_t *vnc);
+int vnc_consumers(vnc_t *vnc);
+void vnc_governor_budget(unsigned int total_fps);
+void vnc_governor_join(vnc_t *vnc);
+void vnc_governor_leave(vnc_t *vnc);
+uint64_t vnc_request_interval(vnc_t *vnc);
 
 #ifdef __cplusplus
 }
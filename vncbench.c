@@ -0,0 +1,278 @@
+#include "vnc.h"
+#include "fakerfb.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+// end to end benchmark of the client against the synthetic server
+// every workload runs for a fixed time over a unix socket, or tcp with -t,
+// followed by repeated connect, first frame and disconnect cycles
+// -S asks for frames scaled down, by the server, or with -c by the client
+
+#define VNCBENCH_DEFAULT_SECONDS 3
+#define VNCBENCH_DEFAULT_HRES 1280
+#define VNCBENCH_DEFAULT_VRES 1024
+
+typedef struct
+{
+    const char *name;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t elapsed;            // ns of wall time
+    uint64_t cpu;                // ns of client thread cpu time
+}
+result_t;
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int run(const fakerfb_cfg_t *cfg, unsigned int scale, unsigned int seconds, result_t *result)
+{
+    fakerfb_t *srv;
+    vnc_view_t view;
+    vnc_t *vnc;
+    uint64_t start, cpu, end;
+    int value = 2;
+    int tries;
+
+    srv = fakerfb_start(cfg);
+    if( !srv )
+    {
+        fprintf(stderr, "could not start the %s server.\n", fakerfb_workload_name(cfg->workload));
+        return 0;
+    }
+
+    vnc = calloc(1, sizeof *vnc);
+    if( !vnc )
+    {
+        fakerfb_stop(srv);
+        return 0;
+    }
+    // a server that can't scale drops the client, start out as if that already happened
+    vnc->cfg.scale = scale;
+    vnc->scale.refused = !cfg->scaling;
+
+    for( tries = 0; tries < 10 && value == 2; tries++ )
+    {
+        value = rfb_connect(vnc, cfg->path ? cfg->path : "127.0.0.1", cfg->path ? 0 : cfg->port);
+        if( value == 2 )
+        {
+            vnc_sleep_ms(50);
+        }
+    }
+    if( value != 1 )
+    {
+        fprintf(stderr, "could not connect to the %s server.\n", fakerfb_workload_name(cfg->workload));
+        vnc_scale_free(vnc);
+        free(vnc);
+        fakerfb_stop(srv);
+        return 0;
+    }
+
+    memset(result, 0, sizeof *result);
+    result->name = fakerfb_workload_name(cfg->workload);
+
+    start = vnc_time_ns();
+    cpu = thread_cpu_ns();
+    end = start + seconds * 1000000000ULL;
+
+    while( vnc_time_ns() < end )
+    {
+        if( !rfb_grab(vnc, 0) )
+        {
+            break;
+        }
+        if( vnc->status.updated )
+        {
+            vnc_view(vnc, &view);
+            vnc->status.updated = 0;
+            result->frames++;
+        }
+    }
+
+    result->elapsed = vnc_time_ns() - start;
+    result->cpu = thread_cpu_ns() - cpu;
+    result->bytes = fakerfb_bytes(srv);
+
+    rfb_disconnect(vnc);
+    vnc_scale_free(vnc);
+    free(vnc->server.name);
+    free(vnc);
+    fakerfb_stop(srv);
+
+    return 1;
+}
+
+// connects, takes the first frame and disconnects again, like a vm that keeps rebooting
+static int run_reconnect(const fakerfb_cfg_t *cfg, unsigned int seconds, result_t *result)
+{
+    fakerfb_t *srv;
+    vnc_t *vnc;
+    uint64_t start, cpu, end;
+    int value;
+    int tries;
+
+    srv = fakerfb_start(cfg);
+    if( !srv )
+    {
+        fprintf(stderr, "could not start the reconnect server.\n");
+        return 0;
+    }
+
+    vnc = calloc(1, sizeof *vnc);
+    if( !vnc )
+    {
+        fakerfb_stop(srv);
+        return 0;
+    }
+
+    memset(result, 0, sizeof *result);
+    result->name = "reconnect";
+
+    start = vnc_time_ns();
+    cpu = thread_cpu_ns();
+    end = start + seconds * 1000000000ULL;
+
+    while( vnc_time_ns() < end )
+    {
+        value = 2;
+        for( tries = 0; tries < 10 && value == 2; tries++ )
+        {
+            value = rfb_connect(vnc, cfg->path ? cfg->path : "127.0.0.1", cfg->path ? 0 : cfg->port);
+            if( value == 2 )
+            {
+                vnc_sleep_ms(50);
+            }
+        }
+        if( value != 1 )
+        {
+            break;
+        }
+
+        while( !vnc->status.updated && rfb_grab(vnc, 0) )
+        {
+        }
+        vnc->status.updated = 0;
+
+        rfb_disconnect(vnc);
+        free(vnc->server.name);
+        vnc->server.name = NULL;
+        result->frames++;
+    }
+
+    result->elapsed = vnc_time_ns() - start;
+    result->cpu = thread_cpu_ns() - cpu;
+    result->bytes = fakerfb_bytes(srv);
+
+    free(vnc);
+    fakerfb_stop(srv);
+
+    return result->frames != 0;
+}
+
+int main(int argc, char *argv[])
+{
+    result_t results[FAKERFB_NUM_WORKLOADS];
+    result_t reconnect;
+    int have_reconnect;
+    unsigned int seconds = VNCBENCH_DEFAULT_SECONDS;
+    unsigned int scale = 0;
+    int client = 0;
+    char path[64];
+    fakerfb_cfg_t cfg;
+    unsigned int i, n = 0;
+    int opt;
+
+    memset(&cfg, 0, sizeof cfg);
+    cfg.width = VNCBENCH_DEFAULT_HRES;
+    cfg.height = VNCBENCH_DEFAULT_VRES;
+    snprintf(path, sizeof path, "/tmp/vncbench-%d.sock", (int)getpid());
+    cfg.path = path;
+
+    while( (opt = getopt(argc, argv, "W:H:s:r:t:S:c")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'W':
+                cfg.width = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'H':
+                cfg.height = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seconds = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                cfg.fps = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                cfg.path = NULL;
+                cfg.port = (uint16_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                scale = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                client = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-W width] [-H height] [-s seconds] [-r fps] [-t tcp port] [-S scale [-c]]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    cfg.scaling = !client;
+
+    for( i = 0; i < FAKERFB_NUM_WORKLOADS; i++ )
+    {
+        cfg.workload = (fakerfb_workload_t)i;
+        if( run(&cfg, scale, seconds, &results[n]) )
+        {
+            n++;
+        }
+    }
+
+    cfg.workload = FAKERFB_RAW;
+    have_reconnect = run_reconnect(&cfg, seconds, &reconnect);
+
+    fprintf(stdout, "\n%ux%u over %s, %u s per workload", cfg.width, cfg.height, cfg.path ? "unix" : "tcp", seconds);
+    if( scale > 1 )
+    {
+        fprintf(stdout, ", scaled 1/%u by the %s", scale, client ? "client" : "server");
+    }
+    fprintf(stdout, "\n");
+    fprintf(stdout, "%-10s %10s %10s %10s %14s\n", "workload", "frames", "fps", "MB/s", "cpu us/frame");
+    for( i = 0; i < n; i++ )
+    {
+        result_t *r = &results[i];
+        double elapsed = r->elapsed / 1e9;
+
+        fprintf(stdout, "%-10s %10lu %10.1f %10.1f %14.2f\n",
+                r->name,
+                (unsigned long)r->frames,
+                r->frames / elapsed,
+                r->bytes / elapsed / (1024.0 * 1024.0),
+                r->frames ? r->cpu / 1e3 / r->frames : 0.0);
+    }
+
+    if( have_reconnect )
+    {
+        fprintf(stdout, "%-10s %10lu %10.1f %10s %14.2f   (cycles, cpu us/cycle)\n",
+                reconnect.name,
+                (unsigned long)reconnect.frames,
+                reconnect.frames / (reconnect.elapsed / 1e9),
+                "-",
+                reconnect.cpu / 1e3 / reconnect.frames);
+    }
+
+    return n == FAKERFB_NUM_WORKLOADS && have_reconnect ? 0 : 1;
+}
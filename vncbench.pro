@@ -0,0 +1,22 @@
+# end to end benchmark against the built in synthetic rfb server
+# build with: qmake vncbench.pro && make
+
+CONFIG -= qt
+CONFIG += console
+
+isEmpty(TARGET_NAME) {
+    TARGET_NAME = vncbench
+}
+TARGET = $$TARGET_NAME
+TEMPLATE = app
+
+include(common.pri)
+
+SOURCES += \
+    vncbench.c \
+    fakerfb.c \
+    $$CORE_SOURCES
+
+HEADERS  += \
+    fakerfb.h \
+    $$CORE_HEADERS
@@ -0,0 +1,456 @@
+#include "vnc.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// decoder microbenchmark
+// each corpus is a server to client byte stream held in memory and decoded with rfb_replay,
+// so only the decoders are measured, never the socket
+
+#define VNCDECBENCH_DEFAULT_SECONDS 2
+#define VNCDECBENCH_DEFAULT_HRES 1280
+#define VNCDECBENCH_DEFAULT_VRES 1024
+#define VNCDECBENCH_UPDATES 32
+
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+    size_t size;
+    uint64_t pixels;             // pixels written by one pass over the stream
+}
+corpus_t;
+
+typedef struct
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int seed;
+}
+geometry_t;
+
+static int corpus_grow(corpus_t *c, size_t n)
+{
+    uint8_t *data;
+    size_t size;
+
+    if( c->len + n <= c->size )
+    {
+        return 1;
+    }
+
+    size = c->size ? c->size : 1 << 20;
+    while( size < c->len + n )
+    {
+        size *= 2;
+    }
+
+    data = realloc(c->data, size);
+    if( !data )
+    {
+        return 0;
+    }
+
+    c->data = data;
+    c->size = size;
+    return 1;
+}
+
+static int corpus_put(corpus_t *c, const void *data, size_t n)
+{
+    if( !corpus_grow(c, n) )
+    {
+        return 0;
+    }
+    memcpy(c->data + c->len, data, n);
+    c->len += n;
+    return 1;
+}
+
+static int corpus_update(corpus_t *c, uint16_t rects)
+{
+    rfbFramebufferUpdateMsg fu;
+
+    memset(&fu, 0, sizeof fu);
+    fu.type = rfbFramebufferUpdate;
+    fu.nRects = ENDIAN16(rects);
+
+    return corpus_put(c, &fu, sz_rfbFramebufferUpdateMsg);
+}
+
+static int corpus_rect(corpus_t *c, unsigned int x, unsigned int y, unsigned int w, unsigned int h, int32_t encoding)
+{
+    rfbFramebufferUpdateRectHeader rh;
+
+    rh.r.x = ENDIAN16((uint16_t)x);
+    rh.r.y = ENDIAN16((uint16_t)y);
+    rh.r.w = ENDIAN16((uint16_t)w);
+    rh.r.h = ENDIAN16((uint16_t)h);
+    rh.encoding = ENDIAN32((uint32_t)encoding);
+
+    c->pixels += (uint64_t)w * h;
+
+    return corpus_put(c, &rh, sz_rfbFramebufferUpdateRectHeader);
+}
+
+// pixel data that changes from rectangle to rectangle, so nothing stays in cache by accident
+static int corpus_raw(corpus_t *c, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned int *seed)
+{
+    size_t n = (size_t)w * h;
+    uint32_t *px;
+    size_t i;
+
+    if( !corpus_rect(c, x, y, w, h, rfbEncodingRaw) || !corpus_grow(c, n * 4) )
+    {
+        return 0;
+    }
+
+    px = (uint32_t *)(c->data + c->len);
+    for( i = 0; i < n; i++ )
+    {
+        *seed = *seed * 1103515245u + 12345u;
+        px[i] = *seed >> 8;
+    }
+    c->len += n * 4;
+
+    return 1;
+}
+
+static int corpus_copyrect(corpus_t *c, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned int sx, unsigned int sy)
+{
+    rfbCopyRect cr;
+
+    cr.srcX = ENDIAN16((uint16_t)sx);
+    cr.srcY = ENDIAN16((uint16_t)sy);
+
+    return corpus_rect(c, x, y, w, h, rfbEncodingCopyRect) && corpus_put(c, &cr, sz_rfbCopyRect);
+}
+
+// whole screen updates, like video or a console redraw
+static int build_raw_full(corpus_t *c, geometry_t *g)
+{
+    unsigned int i;
+
+    for( i = 0; i < VNCDECBENCH_UPDATES; i++ )
+    {
+        if( !corpus_update(c, 1) || !corpus_raw(c, 0, 0, g->width, g->height, &g->seed) )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// scattered 64x64 tiles, like windows being redrawn
+static int build_raw_tiles(corpus_t *c, geometry_t *g)
+{
+    unsigned int i, j;
+
+    for( i = 0; i < VNCDECBENCH_UPDATES; i++ )
+    {
+        if( !corpus_update(c, 16) )
+        {
+            return 0;
+        }
+        for( j = 0; j < 16; j++ )
+        {
+            unsigned int x = (g->seed = g->seed * 1103515245u + 12345u) % (g->width / 64);
+            unsigned int y = (g->seed = g->seed * 1103515245u + 12345u) % (g->height / 64);
+
+            if( !corpus_raw(c, x * 64, y * 64, 64, 64, &g->seed) )
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// 8x16 glyphs, where the per rectangle overhead dominates
+static int build_raw_glyphs(corpus_t *c, geometry_t *g)
+{
+    unsigned int i, j;
+
+    for( i = 0; i < VNCDECBENCH_UPDATES * 4; i++ )
+    {
+        if( !corpus_update(c, 80) )
+        {
+            return 0;
+        }
+        for( j = 0; j < 80; j++ )
+        {
+            unsigned int y = (i * 16) % (g->height - 16);
+
+            if( !corpus_raw(c, j * 8 % (g->width - 8), y, 8, 16, &g->seed) )
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// full width scroll by one text line with the uncovered strip sent raw
+static int build_copyrect_scroll(corpus_t *c, geometry_t *g)
+{
+    unsigned int i;
+
+    for( i = 0; i < VNCDECBENCH_UPDATES; i++ )
+    {
+        if( !corpus_update(c, 2) ||
+            !corpus_copyrect(c, 0, 0, g->width, g->height - 16, 0, 16) ||
+            !corpus_raw(c, 0, g->height - 16, g->width, 16, &g->seed) )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// small overlapping moves, like a window being dragged
+static int build_copyrect_move(corpus_t *c, geometry_t *g)
+{
+    unsigned int i, j;
+
+    for( i = 0; i < VNCDECBENCH_UPDATES * 4; i++ )
+    {
+        if( !corpus_update(c, 8) )
+        {
+            return 0;
+        }
+        for( j = 0; j < 8; j++ )
+        {
+            unsigned int x = 8 + (i * 8 + j * 64) % (g->width - 280);
+            unsigned int y = 8 + (j * 96) % (g->height - 216);
+
+            if( !corpus_copyrect(c, x, y, 256, 192, x - 4 + (j & 1) * 8, y - 4 + (i & 1) * 8) )
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static const struct
+{
+    const char *name;
+    int (*build)(corpus_t *c, geometry_t *g);
+}
+corpora[] =
+{
+    { "raw-full",    build_raw_full },
+    { "raw-tiles",   build_raw_tiles },
+    { "raw-glyphs",  build_raw_glyphs },
+    { "copyrect",    build_copyrect_scroll },
+    { "copy-move",   build_copyrect_move },
+};
+
+// a stream dumped to disk, starting right after the server init message
+static int load_corpus(corpus_t *c, const char *path)
+{
+    FILE *fd;
+    size_t n;
+
+    fd = fopen(path, "rb");
+    if( !fd )
+    {
+        fprintf(stderr, "could not open %s.\n", path);
+        return 0;
+    }
+
+    for( ;; )
+    {
+        if( !corpus_grow(c, 1 << 20) )
+        {
+            fclose(fd);
+            return 0;
+        }
+        n = fread(c->data + c->len, 1, c->size - c->len, fd);
+        if( !n )
+        {
+            break;
+        }
+        c->len += n;
+    }
+
+    fclose(fd);
+    return c->len != 0;
+}
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// the vector extensions the decoders were built for, so runs on different targets can be told apart
+static const char *build_target(void)
+{
+#if defined(__AVX512F__)
+    return "avx512";
+#elif defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE4_2__)
+    return "sse4.2";
+#elif defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "generic";
+#endif
+}
+
+static int run(vnc_t *vnc, const char *name, corpus_t *c, unsigned int seconds)
+{
+    uint64_t start, end, elapsed, tsc;
+    uint64_t passes = 0;
+
+    // decode once first so the framebuffer pages are faulted in
+    if( !rfb_replay(vnc, c->data, c->len) )
+    {
+        fprintf(stderr, "%s: stream failed to decode.\n", name);
+        return 0;
+    }
+
+    start = vnc_time_ns();
+    end = start + seconds * 1000000000ULL;
+    tsc = cycles();
+
+    do
+    {
+        rfb_replay(vnc, c->data, c->len);
+        vnc->status.updated = 0;
+        passes++;
+    }
+    while( vnc_time_ns() < end );
+
+    tsc = cycles() - tsc;
+    elapsed = vnc_time_ns() - start;
+
+    if( tsc )
+    {
+        fprintf(stdout, "%-12s %12lu %10.3f %10.1f %12.3f\n",
+                name,
+                (unsigned long)(c->pixels * passes),
+                c->pixels ? (double)elapsed / (c->pixels * passes) : 0.0,
+                c->len * passes / (elapsed / 1e9) / (1024.0 * 1024.0),
+                (double)c->len * passes / tsc);
+    }
+    else
+    {
+        fprintf(stdout, "%-12s %12lu %10.3f %10.1f %12s\n",
+                name,
+                (unsigned long)(c->pixels * passes),
+                c->pixels ? (double)elapsed / (c->pixels * passes) : 0.0,
+                c->len * passes / (elapsed / 1e9) / (1024.0 * 1024.0),
+                "-");
+    }
+
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int seconds = VNCDECBENCH_DEFAULT_SECONDS;
+    const char *file = NULL;
+    const char *only = NULL;
+    geometry_t g;
+    corpus_t c;
+    vnc_t *vnc;
+    unsigned int i;
+    int status = 0;
+    int opt;
+
+    g.width = VNCDECBENCH_DEFAULT_HRES;
+    g.height = VNCDECBENCH_DEFAULT_VRES;
+    g.seed = 1;
+
+    while( (opt = getopt(argc, argv, "W:H:s:c:f:")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'W':
+                g.width = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'H':
+                g.height = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seconds = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                only = optarg;
+                break;
+            case 'f':
+                file = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-W width] [-H height] [-s seconds] [-c corpus] [-f stream]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if( g.width < 512 || g.height < 256 || (uint64_t)g.width * g.height * 4 > VNC_BUF_SIZE )
+    {
+        fprintf(stderr, "unsupported geometry %ux%u.\n", g.width, g.height);
+        return 1;
+    }
+
+    vnc = calloc(1, sizeof *vnc);
+    if( !vnc )
+    {
+        return 1;
+    }
+
+    // 32 bit true colour, the format the client always asks for
+    vnc->sock = -1;
+    vnc->server.width = g.width;
+    vnc->server.height = g.height;
+    vnc->server.pixelsize = 4;
+    vnc->server.stride = g.width * 4;
+    vnc->cfg.disable_continuous = 1;
+
+    fprintf(stdout, "%ux%u, %s build, %u s per corpus\n", g.width, g.height, build_target(), seconds);
+    fprintf(stdout, "%-12s %12s %10s %10s %12s\n", "corpus", "pixels", "ns/pixel", "MB/s", "bytes/cycle");
+
+    if( file )
+    {
+        memset(&c, 0, sizeof c);
+        if( !load_corpus(&c, file) || !run(vnc, file, &c, seconds) )
+        {
+            status = 1;
+        }
+        free(c.data);
+    }
+    else
+    {
+        for( i = 0; i < sizeof corpora / sizeof corpora[0]; i++ )
+        {
+            if( only && strcmp(only, corpora[i].name) )
+            {
+                continue;
+            }
+
+            memset(&c, 0, sizeof c);
+            if( !corpora[i].build(&c, &g) || !run(vnc, corpora[i].name, &c, seconds) )
+            {
+                status = 1;
+            }
+            free(c.data);
+        }
+    }
+
+    free(vnc);
+    return status;
+}
@@ -0,0 +1,20 @@
+# decoder microbenchmark over synthetic streams held in memory
+# build with: qmake vncdecbench.pro && make
+
+CONFIG -= qt
+CONFIG += console
+
+isEmpty(TARGET_NAME) {
+    TARGET_NAME = vncdecbench
+}
+TARGET = $$TARGET_NAME
+TEMPLATE = app
+
+include(common.pri)
+
+SOURCES += \
+    vncdecbench.c \
+    $$CORE_SOURCES
+
+HEADERS  += \
+    $$CORE_HEADERS
@@ -0,0 +1,185 @@
+#include "vnc.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// plays back session recordings
+// seeks to a point in the recording and writes the screen out as a ppm,
+// or decodes the whole file as fast as possible
+
+// writes one area of the screen, a single monitor or all of it
+static int write_ppm(vnc_t *vnc, const vnc_rect_t *area, const char *path)
+{
+    const uint8_t *row = vnc_pixels(vnc) + area->y * vnc->server.stride + area->x * 4;
+    unsigned int x, y;
+    uint8_t *line;
+    FILE *fd;
+
+    if( vnc->server.pixelsize != 4 )
+    {
+        fprintf(stderr, "only 32 bit frames can be written.\n");
+        return 0;
+    }
+
+    line = malloc((size_t)area->w * 3);
+    if( !line )
+    {
+        return 0;
+    }
+
+    fd = fopen(path, "wb");
+    if( !fd )
+    {
+        fprintf(stderr, "could not write '%s'.\n", path);
+        free(line);
+        return 0;
+    }
+
+    // same byte order the viewer draws with
+    fprintf(fd, "P6\n%u %u\n255\n", area->w, area->h);
+    for( y = 0; y < area->h; y++ )
+    {
+        for( x = 0; x < area->w; x++ )
+        {
+            line[x * 3 + 0] = row[x * 4 + 0];
+            line[x * 3 + 1] = row[x * 4 + 1];
+            line[x * 3 + 2] = row[x * 4 + 2];
+        }
+        fwrite(line, 3, area->w, fd);
+        row += vnc->server.stride;
+    }
+
+    fclose(fd);
+    free(line);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t first, last, time, start, elapsed;
+    const char *out = NULL;
+    double offset = -1;
+    int monitor = -1;
+    int bench = 0;
+    vnc_rect_t area;
+    vnc_replay_t *r;
+    vnc_t *vnc;
+    uint64_t chunks = 0;
+    int status = 0;
+    int opt;
+
+    while( (opt = getopt(argc, argv, "t:o:m:b")) != -1 )
+    {
+        switch( opt )
+        {
+            case 't':
+                offset = strtod(optarg, NULL);
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'm':
+                monitor = atoi(optarg);
+                break;
+            case 'b':
+                bench = 1;
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if( optind != argc - 1 )
+    {
+        fprintf(stderr, "usage: %s [-t seconds] [-o frame.ppm] [-m monitor] [-b] recording\n", argv[0]);
+        return 1;
+    }
+
+    r = vnc_replay_open(argv[optind]);
+    if( !r )
+    {
+        return 1;
+    }
+
+    vnc = calloc(1, sizeof *vnc);
+    if( !vnc )
+    {
+        vnc_replay_close(r);
+        return 1;
+    }
+    vnc->sock = -1;
+
+    // finding the end walks the whole file, a seek to a given time only indexes up to it
+    if( bench || offset < 0 )
+    {
+        vnc_replay_span(r, &first, &last);
+        fprintf(stdout, "recording spans %.3f s.\n", (last - first) / 1e9);
+    }
+    else
+    {
+        vnc_replay_span(r, &first, NULL);
+    }
+
+    if( bench )
+    {
+        start = vnc_time_ns();
+        while( vnc_replay_step(r, vnc, &time) )
+        {
+            chunks++;
+        }
+        elapsed = vnc_time_ns() - start;
+
+        fprintf(stdout, "decoded %lu chunks in %.3f s, %.0fx real time.\n",
+                (unsigned long)chunks, elapsed / 1e9,
+                elapsed ? (double)(last - first) / elapsed : 0.0);
+    }
+    else
+    {
+        // default to the end of the recording
+        time = offset < 0 ? last : first + (uint64_t)(offset * 1e9);
+
+        start = vnc_time_ns();
+        if( !vnc_replay_seek(r, vnc, time) )
+        {
+            fprintf(stderr, "recording is damaged.\n");
+            status = 1;
+        }
+        elapsed = vnc_time_ns() - start;
+
+        fprintf(stdout, "seeked to %.3f s in %.3f ms, %ux%u, %u screen%s%s.\n",
+                (time - first) / 1e9, elapsed / 1e6,
+                vnc->server.width, vnc->server.height,
+                vnc->status.num_screens, vnc->status.num_screens == 1 ? "" : "s",
+                vnc->status.off ? ", vm off" : "");
+
+        area.x = 0;
+        area.y = 0;
+        area.w = vnc->server.width;
+        area.h = vnc->server.height;
+        if( monitor >= 0 )
+        {
+            if( (unsigned int)monitor >= vnc->status.num_screens )
+            {
+                fprintf(stderr, "no screen %d.\n", monitor);
+                status = 1;
+            }
+            else
+            {
+                area = vnc->status.screens[monitor].rect;
+            }
+        }
+
+        if( !status && out && !write_ppm(vnc, &area, out) )
+        {
+            status = 1;
+        }
+    }
+
+    free(vnc);
+    vnc_replay_close(r);
+    return status;
+}
@@ -0,0 +1,20 @@
+# plays back session recordings
+# build with: qmake vncplay.pro && make
+
+CONFIG -= qt
+CONFIG += console
+
+isEmpty(TARGET_NAME) {
+    TARGET_NAME = vncplay
+}
+TARGET = $$TARGET_NAME
+TEMPLATE = app
+
+include(common.pri)
+
+SOURCES += \
+    vncplay.c \
+    $$CORE_SOURCES
+
+HEADERS  += \
+    $$CORE_HEADERS
@@ -0,0 +1,439 @@
+#include "vnc.h"
+#include "vncxfer.h"
+#include "trace.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the library handle, the client state stays private so vnc_t can change freely
+struct vncxfer
+{
+    vnc_t vnc;
+    char *uuid;
+    char *socket;
+    char *record;
+    vnc_replay_t *replay;        // set for handles playing a recording instead of a connection
+    uint64_t frames;
+    unsigned int num_damage;
+    vnc_rect_t damage[VNC_MAX_DAMAGE];
+    unsigned int num_screens;
+    vnc_screen_t screens[VNC_MAX_SCREENS];
+};
+
+int vncxfer_version(void)
+{
+    return VNCXFER_API_VERSION;
+}
+
+vncxfer_t *vncxfer_open(const char *uuid, const char *socket, uint16_t port)
+{
+    vncxfer_t *x;
+
+    if( !socket )
+    {
+        return NULL;
+    }
+
+    // the framebuffer is only touched as far as the screen reaches
+    x = calloc(1, sizeof *x);
+    if( !x )
+    {
+        return NULL;
+    }
+
+    x->uuid = strdup(uuid ? uuid : socket);
+    x->socket = strdup(socket);
+    if( !x->uuid || !x->socket )
+    {
+        vncxfer_close(x);
+        return NULL;
+    }
+
+    x->vnc.sock = -1;
+    x->vnc.cfg.uuid = x->uuid;
+    x->vnc.cfg.socket = x->socket;
+    x->vnc.cfg.port = port;
+
+    vnc_vm_off(&x->vnc);
+
+    return x;
+}
+
+vncxfer_t *vncxfer_open_recording(const char *path)
+{
+    vncxfer_t *x;
+
+    x = calloc(1, sizeof *x);
+    if( !x )
+    {
+        return NULL;
+    }
+
+    x->vnc.sock = -1;
+    x->uuid = strdup(path);
+    x->vnc.cfg.uuid = x->uuid;
+
+    // start out showing the first keyframe
+    x->replay = vnc_replay_open(path);
+    if( !x->uuid || !x->replay || !vnc_replay_seek(x->replay, &x->vnc, 0) )
+    {
+        vncxfer_close(x);
+        return NULL;
+    }
+
+    return x;
+}
+
+void vncxfer_close(vncxfer_t *x)
+{
+    if( !x )
+    {
+        return;
+    }
+
+    if( x->replay )
+    {
+        vnc_replay_close(x->replay);
+    }
+    else if( !x->vnc.status.off )
+    {
+        rfb_disconnect(&x->vnc);
+    }
+
+    vnc_record_close(x->vnc.record);
+    vnc_scale_free(&x->vnc);
+    free(x->vnc.server.name);
+    free(x->record);
+    free(x->uuid);
+    free(x->socket);
+    free(x);
+}
+
+void vncxfer_set_fps(vncxfer_t *x, unsigned int fps, unsigned int idle_fps)
+{
+    x->vnc.cfg.fps = fps;
+    x->vnc.cfg.idle_fps = idle_fps;
+}
+
+void vncxfer_set_window(vncxfer_t *x, unsigned int window)
+{
+    x->vnc.cfg.window = window;
+}
+
+void vncxfer_set_scale(vncxfer_t *x, unsigned int scale)
+{
+    x->vnc.cfg.scale = scale < VNC_SCALE_MAX ? scale : VNC_SCALE_MAX;
+}
+
+void vncxfer_set_cursor(vncxfer_t *x, int separate)
+{
+    x->vnc.cfg.disable_cursor = !separate;
+}
+
+int vncxfer_set_record(vncxfer_t *x, const char *path, unsigned int keyframe_ms)
+{
+    char *copy = NULL;
+
+    if( path )
+    {
+        copy = strdup(path);
+        if( !copy )
+        {
+            return 0;
+        }
+    }
+
+    free(x->record);
+    x->record = copy;
+    x->vnc.cfg.record = copy;
+    x->vnc.cfg.record_keyframe_ms = keyframe_ms;
+
+    return 1;
+}
+
+int vncxfer_set_roi(vncxfer_t *x, const vncxfer_rect_t *rects, unsigned int count)
+{
+    vnc_rect_t roi[VNC_MAX_ROI];
+    unsigned int i;
+
+    if( count > VNC_MAX_ROI )
+    {
+        return 0;
+    }
+
+    for( i = 0; i < count; i++ )
+    {
+        roi[i].x = rects[i].x;
+        roi[i].y = rects[i].y;
+        roi[i].w = rects[i].w;
+        roi[i].h = rects[i].h;
+    }
+
+    return vnc_set_roi(&x->vnc, roi, count);
+}
+
+void vncxfer_attach(vncxfer_t *x)
+{
+    vnc_attach(&x->vnc);
+}
+
+void vncxfer_detach(vncxfer_t *x)
+{
+    vnc_detach(&x->vnc);
+}
+
+int vncxfer_connect(vncxfer_t *x)
+{
+    if( x->replay )
+    {
+        return 0;
+    }
+
+    if( !x->vnc.status.off )
+    {
+        return 1;
+    }
+
+    // the server name is reallocated on every handshake
+    free(x->vnc.server.name);
+    x->vnc.server.name = NULL;
+
+    return rfb_connect(&x->vnc, x->socket, x->vnc.cfg.port);
+}
+
+unsigned int vncxfer_retry_ms(vncxfer_t *x)
+{
+    return vnc_backoff_next(&x->vnc);
+}
+
+int vncxfer_poll(vncxfer_t *x)
+{
+    if( x->vnc.status.off || x->replay )
+    {
+        return 0;
+    }
+
+    return rfb_grab(&x->vnc, 0);
+}
+
+int vncxfer_fd(vncxfer_t *x)
+{
+    return x->vnc.status.off || x->replay ? -1 : x->vnc.sock;
+}
+
+int vncxfer_feed(vncxfer_t *x)
+{
+    if( x->vnc.status.off || x->replay )
+    {
+        return 0;
+    }
+
+    return rfb_process(&x->vnc);
+}
+
+int vncxfer_tick(vncxfer_t *x)
+{
+    int timeout;
+
+    if( x->vnc.status.off || x->replay )
+    {
+        return -1;
+    }
+
+    timeout = rfb_tick(&x->vnc);
+    if( timeout < 0 )
+    {
+        rfb_disconnect(&x->vnc);
+    }
+
+    return timeout;
+}
+
+int vncxfer_frame(vncxfer_t *x, vncxfer_frame_t *frame)
+{
+    vnc_t *vnc = &x->vnc;
+    vnc_view_t view;
+    VNC_TRACE_VAR(trace_publish)
+
+    // callers built against version 2 pass the smaller structure
+    if( !frame || frame->size < offsetof(vncxfer_frame_t, num_screens) )
+    {
+        return 0;
+    }
+
+    if( !vnc->status.updated && !vnc->status.fbsize_updated )
+    {
+        return 0;
+    }
+
+    VNC_TRACE_START(trace_publish);
+
+    // keep a copy so the damage can be walked while the next update decodes
+    vnc_view(vnc, &view);
+    x->num_damage = view.num_damage;
+    memcpy(x->damage, view.damage, x->num_damage * sizeof(vnc_rect_t));
+    x->num_screens = view.num_screens;
+    memcpy(x->screens, view.screens, x->num_screens * sizeof(vnc_screen_t));
+    if( vnc->status.updated )
+    {
+        vnc_stats_published(vnc);
+    }
+    vnc->status.updated = 0;
+    vnc->status.fbsize_updated = 0;
+
+    frame->pixels = view.pixels;
+    frame->width = view.width;
+    frame->height = view.height;
+    frame->stride = view.stride;
+    frame->pixelsize = view.pixelsize;
+    frame->num_damage = x->num_damage;
+    frame->off = vnc->status.off;
+    frame->frame = ++x->frames;
+    if( frame->size >= sizeof *frame )
+    {
+        frame->num_screens = x->num_screens;
+    }
+    VNC_TRACE_SPAN("publish", trace_publish);
+
+    return 1;
+}
+
+int vncxfer_damage(vncxfer_t *x, unsigned int index, vncxfer_rect_t *rect)
+{
+    if( index >= x->num_damage )
+    {
+        return 0;
+    }
+
+    rect->x = x->damage[index].x;
+    rect->y = x->damage[index].y;
+    rect->w = x->damage[index].w;
+    rect->h = x->damage[index].h;
+
+    return 1;
+}
+
+int vncxfer_screen(vncxfer_t *x, unsigned int index, vncxfer_screen_t *screen)
+{
+    if( index >= x->num_screens )
+    {
+        return 0;
+    }
+
+    screen->id = x->screens[index].id;
+    screen->rect.x = x->screens[index].rect.x;
+    screen->rect.y = x->screens[index].rect.y;
+    screen->rect.w = x->screens[index].rect.w;
+    screen->rect.h = x->screens[index].rect.h;
+
+    return 1;
+}
+
+int vncxfer_cursor(vncxfer_t *x, vncxfer_cursor_t *cursor)
+{
+    vnc_cursor_t *c = &x->vnc.cursor;
+
+    if( !cursor || cursor->size < sizeof *cursor || !c->updated )
+    {
+        return 0;
+    }
+    c->updated = 0;
+
+    cursor->x = c->x;
+    cursor->y = c->y;
+    cursor->hotx = c->hotx;
+    cursor->hoty = c->hoty;
+    cursor->width = c->width;
+    cursor->height = c->height;
+    cursor->pixels = c->pixels;
+    cursor->mask = c->mask;
+    cursor->serial = c->serial;
+
+    return 1;
+}
+
+void vncxfer_draw_cursor(vncxfer_t *x, uint8_t *pixels, unsigned int stride, unsigned int width, unsigned int height)
+{
+    vnc_cursor_draw(&x->vnc, pixels, stride, width, height);
+}
+
+int vncxfer_seek(vncxfer_t *x, uint64_t time_ns)
+{
+    if( !x->replay )
+    {
+        return 0;
+    }
+
+    return vnc_replay_seek(x->replay, &x->vnc, time_ns);
+}
+
+int vncxfer_step(vncxfer_t *x, uint64_t *time_ns)
+{
+    if( !x->replay )
+    {
+        return 0;
+    }
+
+    return vnc_replay_step(x->replay, &x->vnc, time_ns);
+}
+
+int vncxfer_span(vncxfer_t *x, uint64_t *first_ns, uint64_t *last_ns)
+{
+    if( !x->replay )
+    {
+        return 0;
+    }
+
+    vnc_replay_span(x->replay, first_ns, last_ns);
+    return 1;
+}
+
+int vncxfer_stats(vncxfer_t *x, vncxfer_stats_t *stats)
+{
+    const vnc_stats_t *s = &x->vnc.stats;
+
+    // callers built against version 1 pass the smaller structure
+    if( !stats || stats->size < offsetof(vncxfer_stats_t, bytes) )
+    {
+        return 0;
+    }
+
+    stats->frames = x->frames;
+    stats->handshake_ns = x->vnc.handshake_time;
+    stats->first_frame_ns = x->vnc.first_frame_time;
+    stats->attempts = x->vnc.attempts;
+    stats->connected = !x->vnc.status.off;
+
+    if( stats->size < sizeof *stats )
+    {
+        return 1;
+    }
+
+    stats->bytes = s->bytes;
+    stats->updates = s->updates;
+    stats->dropped = s->dropped;
+    stats->reconnects = s->connects ? s->connects - 1 : 0;
+    stats->failures = s->failures;
+    stats->rects_raw = s->rects[VNC_STAT_RAW];
+    stats->rects_copyrect = s->rects[VNC_STAT_COPYRECT];
+    stats->rects_other = s->rects[VNC_STAT_NEWFBSIZE] + s->rects[VNC_STAT_CURSOR] + s->rects[VNC_STAT_OTHER];
+    stats->request_p50_ns = vnc_hist_percentile(&s->request_latency, 50);
+    stats->request_p99_ns = vnc_hist_percentile(&s->request_latency, 99);
+    stats->decode_p50_ns = vnc_hist_percentile(&s->decode_time, 50);
+    stats->decode_p99_ns = vnc_hist_percentile(&s->decode_time, 99);
+    stats->publish_p50_ns = vnc_hist_percentile(&s->publish_latency, 50);
+    stats->publish_p99_ns = vnc_hist_percentile(&s->publish_latency, 99);
+
+    return 1;
+}
+
+int vncxfer_stats_text(vncxfer_t *x, char *buf, size_t len)
+{
+    return vnc_stats_text(&x->vnc, buf, len);
+}
+
+int vncxfer_trace_dump(const char *path)
+{
+    return vnc_trace_dump(path);
+}
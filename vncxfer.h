@@ -0,0 +1,169 @@
+#ifndef VNCXFER_H
+#define VNCXFER_H
+
+// public interface of libvncxfer
+// only the types and functions here are exported, everything in vnc.h is internal
+// structures handed to the library start with their size so they can grow later
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VNCXFER_API_VERSION 5
+
+#if defined(VNCXFER_BUILD) && !defined(_WIN32)
+#define VNCXFER_API __attribute__((visibility("default")))
+#else
+#define VNCXFER_API
+#endif
+
+typedef struct vncxfer vncxfer_t;
+
+typedef struct
+{
+    unsigned int x;
+    unsigned int y;
+    unsigned int w;
+    unsigned int h;
+}
+vncxfer_rect_t;
+
+// a guest monitor, an area of the frame
+typedef struct
+{
+    uint32_t id;
+    vncxfer_rect_t rect;
+}
+vncxfer_screen_t;
+
+typedef struct
+{
+    size_t size;                 // set to sizeof(vncxfer_frame_t) before calling
+    const uint8_t *pixels;       // valid until the next call into this handle
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    unsigned int pixelsize;
+    unsigned int num_damage;     // rectangles changed since the previous frame
+    int off;                     // vm is off, pixels hold the placeholder
+    uint64_t frame;              // counts up with every frame returned
+
+    // api version 3, only filled in when size covers them
+    unsigned int num_screens;    // guest monitors, 1 covering the frame if the server has no layout
+}
+vncxfer_frame_t;
+
+// the pointer, kept out of the frames when the server supports it
+typedef struct
+{
+    size_t size;                 // set to sizeof(vncxfer_cursor_t) before calling
+    unsigned int x;              // pointer position in the vm's framebuffer, before any scaling
+    unsigned int y;
+    unsigned int hotx;           // point of the image at the pointer position
+    unsigned int hoty;
+    unsigned int width;          // 0 when there is no shape to draw
+    unsigned int height;
+    const uint8_t *pixels;       // frame pixel format, rows packed, valid until the next call into this handle
+    const uint8_t *mask;         // a byte per pixel, 0xff where the image is opaque
+    uint32_t serial;             // changes with every new shape
+}
+vncxfer_cursor_t;
+
+typedef struct
+{
+    size_t size;                 // set to sizeof(vncxfer_stats_t) before calling
+    uint64_t frames;             // frames returned by vncxfer_frame
+    uint64_t handshake_ns;       // time to connect and negotiate, last connection
+    uint64_t first_frame_ns;     // time from connecting to the first update, last connection
+    unsigned int attempts;       // failed connection attempts since the last success
+    int connected;
+
+    // api version 2, only filled in when size covers them
+    uint64_t bytes;              // read from the server
+    uint64_t updates;            // updates decoded, several can make up one frame
+    uint64_t dropped;            // updates merged because the previous frame wasn't taken yet
+    uint64_t reconnects;
+    uint64_t failures;           // connections lost during the handshake
+    uint64_t rects_raw;
+    uint64_t rects_copyrect;
+    uint64_t rects_other;
+    uint64_t request_p50_ns;     // update request sent to its update arriving
+    uint64_t request_p99_ns;
+    uint64_t decode_p50_ns;      // time to decode one update
+    uint64_t decode_p99_ns;
+    uint64_t publish_p50_ns;     // update decoded to taken by vncxfer_frame
+    uint64_t publish_p99_ns;
+}
+vncxfer_stats_t;
+
+VNCXFER_API int vncxfer_version(void);
+
+// socket is a unix socket path, or an ipv4 address when port is not 0
+VNCXFER_API vncxfer_t *vncxfer_open(const char *uuid, const char *socket, uint16_t port);
+VNCXFER_API void vncxfer_close(vncxfer_t *x);
+
+// options, set before connecting
+VNCXFER_API void vncxfer_set_fps(vncxfer_t *x, unsigned int fps, unsigned int idle_fps);
+VNCXFER_API void vncxfer_set_window(vncxfer_t *x, unsigned int window);
+// appends the session to path from the next connection on, see record.h for the format
+VNCXFER_API int vncxfer_set_record(vncxfer_t *x, const char *path, unsigned int keyframe_ms);
+// frames at 1/scale of the vm's size, for thumbnails, 0 or 1 for full size
+// the server does the scaling when it supports rfbSetScale, otherwise the library does
+VNCXFER_API void vncxfer_set_scale(vncxfer_t *x, unsigned int scale);
+// 1 (the default) keeps the cursor out of the frames, see vncxfer_cursor; 0 lets the server draw it in
+VNCXFER_API void vncxfer_set_cursor(vncxfer_t *x, int separate);
+VNCXFER_API int vncxfer_set_roi(vncxfer_t *x, const vncxfer_rect_t *rects, unsigned int count);
+VNCXFER_API void vncxfer_attach(vncxfer_t *x);
+VNCXFER_API void vncxfer_detach(vncxfer_t *x);
+
+// returns 0 on a fatal error, 1 when connected, 2 if it should be retried
+// after vncxfer_retry_ms() or once the socket appears
+VNCXFER_API int vncxfer_connect(vncxfer_t *x);
+VNCXFER_API unsigned int vncxfer_retry_ms(vncxfer_t *x);
+
+// blocking use: waits up to the next request deadline and handles one message
+// returns 0 once the connection is lost, the off placeholder is then shown
+VNCXFER_API int vncxfer_poll(vncxfer_t *x);
+
+// event loop use: wait for vncxfer_fd to be readable, then call vncxfer_feed
+// call vncxfer_tick at least as often as it asks (in ms)
+VNCXFER_API int vncxfer_fd(vncxfer_t *x);
+VNCXFER_API int vncxfer_feed(vncxfer_t *x);
+VNCXFER_API int vncxfer_tick(vncxfer_t *x);
+
+// returns 1 and fills frame if anything changed since the last call
+VNCXFER_API int vncxfer_frame(vncxfer_t *x, vncxfer_frame_t *frame);
+VNCXFER_API int vncxfer_damage(vncxfer_t *x, unsigned int index, vncxfer_rect_t *rect);
+// monitors of the last frame, capture each of them on its own to skip the space between them
+VNCXFER_API int vncxfer_screen(vncxfer_t *x, unsigned int index, vncxfer_screen_t *screen);
+// returns 1 and fills cursor if the pointer moved or changed shape since the last call
+VNCXFER_API int vncxfer_cursor(vncxfer_t *x, vncxfer_cursor_t *cursor);
+// draws the cursor into a copy of a frame, clipped to width and height
+VNCXFER_API void vncxfer_draw_cursor(vncxfer_t *x, uint8_t *pixels, unsigned int stride, unsigned int width, unsigned int height);
+
+// playback of recordings made with vncxfer_set_record
+// frames are read with vncxfer_frame as for a live display, connecting and polling are not available
+// times are wall clock ns, as stored in the recording
+// keyframes are indexed as seeks reach them, asking vncxfer_span for the last time walks the whole file
+VNCXFER_API vncxfer_t *vncxfer_open_recording(const char *path);
+VNCXFER_API int vncxfer_seek(vncxfer_t *x, uint64_t time_ns);
+VNCXFER_API int vncxfer_step(vncxfer_t *x, uint64_t *time_ns);
+VNCXFER_API int vncxfer_span(vncxfer_t *x, uint64_t *first_ns, uint64_t *last_ns);
+
+VNCXFER_API int vncxfer_stats(vncxfer_t *x, vncxfer_stats_t *stats);
+
+// every counter and histogram as text, returns the length needed like snprintf
+VNCXFER_API int vncxfer_stats_text(vncxfer_t *x, char *buf, size_t len);
+
+// writes the trace events of every thread to path in the chrome trace format
+// returns 0 unless the library was built with tracing (qmake CONFIG+=trace)
+VNCXFER_API int vncxfer_trace_dump(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
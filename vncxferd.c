@@ -0,0 +1,582 @@
+#include "vnc.h"
+#include "vncxferd.h"
+#include "trace.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+
+// headless capture daemon
+// runs every display listed in the config on its own thread and publishes
+// the framebuffers through shared memory, no qt involved
+
+#define VNCXFERD_DEFAULT_CONFIG "/etc/vncxferd.conf"
+#define VNCXFERD_MAX_LINE 1024
+
+// how long a metrics client gets to send its request and read the answer
+#define VNCXFERD_METRICS_TIMEOUT_MS 1000
+
+typedef struct display
+{
+    vnc_t vnc;
+    vnc_shm_header_t *shm;
+    int writing;                 // seq is odd, pixels in the shared buffer are changing
+    char shm_name[256];
+    pthread_t thread;
+    struct display *next;
+}
+display_t;
+
+static display_t *displays;
+static char *metrics_path;
+static pthread_t metrics_tid;
+static int metrics_fd = -1;
+static int metrics_stopping;
+static char *trace_path;
+
+// answers one scrape, plain http if the client asked for it so prometheus can talk to the socket directly
+static void metrics_serve(int fd, vnc_t *const *vncs, unsigned int count)
+{
+    struct timeval tv = { VNCXFERD_METRICS_TIMEOUT_MS / 1000, (VNCXFERD_METRICS_TIMEOUT_MS % 1000) * 1000 };
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    char req[1024];
+    ssize_t len = 0;
+    FILE *out;
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+    if( poll(&pfd, 1, VNCXFERD_METRICS_TIMEOUT_MS) > 0 )
+    {
+        len = recv(fd, req, sizeof req - 1, MSG_DONTWAIT);
+    }
+
+    out = fdopen(fd, "w");
+    if( !out )
+    {
+        close(fd);
+        return;
+    }
+
+    if( len >= 4 && !memcmp(req, "GET ", 4) )
+    {
+        fprintf(out, "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Connection: close\r\n\r\n");
+    }
+    vnc_stats_prometheus(out, vncs, count);
+
+    fclose(out);
+}
+
+static void *metrics_thread(void *arg)
+{
+    int listener = (int)(intptr_t)arg;
+    unsigned int count = 0;
+    vnc_t **vncs;
+    display_t *d;
+    int fd;
+
+    for( d = displays; d; d = d->next )
+    {
+        count++;
+    }
+
+    vncs = calloc(count, sizeof *vncs);
+    if( !vncs )
+    {
+        return NULL;
+    }
+
+    count = 0;
+    for( d = displays; d; d = d->next )
+    {
+        vncs[count++] = &d->vnc;
+    }
+
+    // scrapes are rare and cheap, one at a time is plenty
+    while( 1 )
+    {
+        fd = accept(listener, NULL, NULL);
+        if( fd < 0 )
+        {
+            if( __atomic_load_n(&metrics_stopping, __ATOMIC_ACQUIRE) )
+            {
+                break;
+            }
+            if( errno == EINTR || errno == ECONNABORTED )
+            {
+                continue;
+            }
+            fprintf(stderr, "metrics accept failed: %s\n", strerror(errno));
+            break;
+        }
+        metrics_serve(fd, vncs, count);
+    }
+
+    free(vncs);
+    return NULL;
+}
+
+static int metrics_start(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if( strlen(path) >= sizeof addr.sun_path )
+    {
+        fprintf(stderr, "metrics socket path is too long.\n");
+        return 0;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if( fd < 0 )
+    {
+        return 0;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if( bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 8) < 0 )
+    {
+        fprintf(stderr, "could not listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    if( pthread_create(&metrics_tid, NULL, metrics_thread, (void *)(intptr_t)fd) )
+    {
+        close(fd);
+        unlink(path);
+        return 0;
+    }
+    metrics_fd = fd;
+
+    return 1;
+}
+
+// scrapes read the displays' recordings, so this has to finish before the displays stop
+// shutting the listener down wakes the accept, a scrape already in progress is let finish
+static void metrics_stop(const char *path)
+{
+    if( metrics_fd < 0 )
+    {
+        return;
+    }
+
+    __atomic_store_n(&metrics_stopping, 1, __ATOMIC_RELEASE);
+    shutdown(metrics_fd, SHUT_RDWR);
+    pthread_join(metrics_tid, NULL);
+    close(metrics_fd);
+    metrics_fd = -1;
+    unlink(path);
+}
+
+// the pointer goes next to the frame, the shape is only copied when it changes
+static void display_cursor(vnc_t *vnc, vnc_shm_header_t *hdr)
+{
+    const vnc_cursor_t *c = &vnc->cursor;
+    uint8_t *area = (uint8_t *)hdr + VNC_SHM_CURSOR_OFFSET;
+
+    if( hdr->cursor_serial != c->serial )
+    {
+        memcpy(area, c->pixels, (size_t)c->width * c->height * vnc->server.pixelsize);
+        memcpy(area + VNC_SHM_CURSOR_MASK, c->mask, (size_t)c->width * c->height);
+    }
+
+    hdr->cursor_x = c->x;
+    hdr->cursor_y = c->y;
+    hdr->cursor_hotx = c->hotx;
+    hdr->cursor_hoty = c->hoty;
+    hdr->cursor_width = c->width;
+    hdr->cursor_height = c->height;
+    hdr->cursor_serial = c->serial;
+    vnc->cursor.updated = 0;
+}
+
+// pixels are about to change in the shared buffer, seq stays odd until they are published
+static void display_begin_write(vnc_t *vnc)
+{
+    display_t *d = vnc->cfg.user;
+
+    if( !d->writing )
+    {
+        d->writing = 1;
+        __atomic_add_fetch(&d->shm->seq, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+// make the latest update visible to readers
+static void display_publish(vnc_t *vnc)
+{
+    display_t *d = vnc->cfg.user;
+    vnc_shm_header_t *hdr = d->shm;
+    vnc_view_t view;
+
+    // consumers attach through the shared header, so the idle rate and reconnect priority follow them
+    __atomic_store_n(&vnc->consumers, (int)__atomic_load_n(&hdr->readers, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+    if( !d->writing && !vnc->status.fbsize_updated && !vnc->status.updated && !vnc->cursor.updated )
+    {
+        return;
+    }
+
+    // scaled displays fill the shared buffer from here
+    display_begin_write(vnc);
+    vnc_view(vnc, &view);
+
+    hdr->off = vnc->status.off;
+    hdr->width = view.width;
+    hdr->height = view.height;
+    hdr->stride = view.stride;
+    hdr->pixelsize = view.pixelsize;
+    hdr->num_damage = view.num_damage;
+    memcpy(hdr->damage, view.damage, view.num_damage * sizeof(vnc_rect_t));
+    hdr->num_screens = view.num_screens;
+    memcpy(hdr->screens, view.screens, view.num_screens * sizeof(vnc_screen_t));
+    if( vnc->cursor.updated )
+    {
+        display_cursor(vnc, hdr);
+    }
+    hdr->frames++;
+    hdr->timestamp = vnc_time_ns();
+
+    __atomic_add_fetch(&hdr->seq, 1, __ATOMIC_RELEASE);
+    d->writing = 0;
+
+    vnc->status.fbsize_updated = 0;
+    vnc->status.updated = 0;
+}
+
+// create the shared memory object the display decodes into
+static int display_map(display_t *d)
+{
+    void *map;
+    int fd;
+
+    snprintf(d->shm_name, sizeof d->shm_name, "%s%s", VNC_SHM_PREFIX, d->vnc.cfg.uuid);
+
+    fd = shm_open(d->shm_name, O_RDWR | O_CREAT, 0644);
+    if( fd < 0 )
+    {
+        fprintf(stderr, "could not create %s: %s\n", d->shm_name, strerror(errno));
+        return 0;
+    }
+
+    if( ftruncate(fd, VNC_SHM_SIZE) < 0 )
+    {
+        fprintf(stderr, "could not size %s: %s\n", d->shm_name, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, VNC_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if( map == MAP_FAILED )
+    {
+        fprintf(stderr, "could not map %s: %s\n", d->shm_name, strerror(errno));
+        return 0;
+    }
+
+    d->shm = map;
+    d->shm->magic = VNC_SHM_MAGIC;
+    d->shm->version = VNC_SHM_VERSION;
+
+    d->vnc.cfg.buffer = (uint8_t *)map + VNC_SHM_DATA_OFFSET;
+    d->vnc.cfg.use_buffer = 1;
+    d->vnc.cfg.publish = display_publish;
+    d->vnc.cfg.begin_write = display_begin_write;
+    d->vnc.cfg.user = d;
+
+    return 1;
+}
+
+// display <uuid> <socket or address> [port] [option=value ...]
+// a display that never got past parsing, the strings are the only thing it owns
+static void display_free(display_t *d)
+{
+    free((char *)d->vnc.cfg.uuid);
+    free((char *)d->vnc.cfg.socket);
+    free((char *)d->vnc.cfg.record);
+    free(d);
+}
+
+static int parse_display(char *args, unsigned int line)
+{
+    display_t *d;
+    char *uuid, *socket, *tok;
+    char *save;
+
+    uuid = strtok_r(args, " \t", &save);
+    socket = strtok_r(NULL, " \t", &save);
+    if( !uuid || !socket )
+    {
+        fprintf(stderr, "line %u: display needs a uuid and a socket.\n", line);
+        return 0;
+    }
+
+    d = calloc(1, sizeof *d);
+    if( !d )
+    {
+        return 0;
+    }
+
+    d->vnc.cfg.uuid = strdup(uuid);
+    d->vnc.cfg.socket = strdup(socket);
+
+    while( (tok = strtok_r(NULL, " \t", &save)) )
+    {
+        char *value = strchr(tok, '=');
+        unsigned long n;
+
+        if( !value )
+        {
+            d->vnc.cfg.port = (uint16_t)strtoul(tok, NULL, 10);
+            continue;
+        }
+
+        *value++ = 0;
+        n = strtoul(value, NULL, 10);
+
+        if( !strcmp(tok, "fps") )
+        {
+            d->vnc.cfg.fps = (unsigned int)n;
+        }
+        else if( !strcmp(tok, "idle_fps") )
+        {
+            d->vnc.cfg.idle_fps = (unsigned int)n;
+        }
+        else if( !strcmp(tok, "window") )
+        {
+            d->vnc.cfg.window = (unsigned int)n;
+        }
+        else if( !strcmp(tok, "continuous") )
+        {
+            d->vnc.cfg.disable_continuous = !n;
+        }
+        else if( !strcmp(tok, "scale") )
+        {
+            d->vnc.cfg.scale = n < VNC_SCALE_MAX ? (unsigned int)n : VNC_SCALE_MAX;
+        }
+        else if( !strcmp(tok, "cursor") )
+        {
+            d->vnc.cfg.disable_cursor = !n;
+        }
+        else if( !strcmp(tok, "record") )
+        {
+            free((char *)d->vnc.cfg.record);
+            d->vnc.cfg.record = strdup(value);
+        }
+        else if( !strcmp(tok, "keyframe_ms") )
+        {
+            d->vnc.cfg.record_keyframe_ms = (unsigned int)n;
+        }
+        else
+        {
+            fprintf(stderr, "line %u: unknown option '%s'.\n", line, tok);
+            display_free(d);
+            return 0;
+        }
+    }
+
+    if( !display_map(d) )
+    {
+        display_free(d);
+        return 0;
+    }
+
+    d->next = displays;
+    displays = d;
+
+    return 1;
+}
+
+static int parse_config(const char *path)
+{
+    char buf[VNCXFERD_MAX_LINE];
+    unsigned int line = 0;
+    FILE *fd;
+
+    fd = fopen(path, "r");
+    if( !fd )
+    {
+        fprintf(stderr, "could not open config '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    while( fgets(buf, sizeof buf, fd) )
+    {
+        char *key, *args;
+
+        line++;
+        buf[strcspn(buf, "#\r\n")] = 0;
+
+        key = buf + strspn(buf, " \t");
+        if( !*key )
+        {
+            continue;
+        }
+
+        args = key + strcspn(key, " \t");
+        if( *args )
+        {
+            *args++ = 0;
+        }
+
+        if( !strcmp(key, "display") )
+        {
+            if( !parse_display(args, line) )
+            {
+                fclose(fd);
+                return 0;
+            }
+        }
+        else if( !strcmp(key, "max_handshakes") )
+        {
+            vnc_sched_init((unsigned int)strtoul(args, NULL, 10));
+        }
+        else if( !strcmp(key, "fps_budget") )
+        {
+            vnc_governor_budget((unsigned int)strtoul(args, NULL, 10));
+        }
+        else if( !strcmp(key, "log_level") )
+        {
+            static const char *const levels[] = { "error", "warning", "info", "debug" };
+            int level;
+
+            args[strcspn(args, " \t")] = 0;
+            for( level = VNC_LOG_ERROR; level <= VNC_LOG_DEBUG && strcmp(args, levels[level]); level++ );
+            if( level > VNC_LOG_DEBUG )
+            {
+                fprintf(stderr, "line %u: unknown log level '%s'.\n", line, args);
+                fclose(fd);
+                return 0;
+            }
+            vnc_log_level(level);
+        }
+        else if( !strcmp(key, "trace") )
+        {
+            args[strcspn(args, " \t")] = 0;
+            free(trace_path);
+            trace_path = strdup(args);
+        }
+        else if( !strcmp(key, "metrics") )
+        {
+            args[strcspn(args, " \t")] = 0;
+            free(metrics_path);
+            metrics_path = strdup(args);
+        }
+        else
+        {
+            fprintf(stderr, "line %u: unknown setting '%s'.\n", line, key);
+            fclose(fd);
+            return 0;
+        }
+    }
+
+    fclose(fd);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *config = VNCXFERD_DEFAULT_CONFIG;
+    display_t *d;
+    sigset_t set;
+    int sig;
+    int opt;
+
+    while( (opt = getopt(argc, argv, "c:")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'c':
+                config = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-c config]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if( !parse_config(config) )
+    {
+        return 1;
+    }
+
+    if( !displays )
+    {
+        fprintf(stderr, "no displays configured.\n");
+        return 1;
+    }
+
+    // a vm going away mid write shouldn't take everyone else with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // only the main thread handles shutdown
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for( d = displays; d; d = d->next )
+    {
+        if( pthread_create(&d->thread, NULL, vnc_thread, &d->vnc) )
+        {
+            fprintf(stderr, "could not start %s.\n", d->vnc.cfg.uuid);
+            return 1;
+        }
+    }
+
+    if( metrics_path && !metrics_start(metrics_path) )
+    {
+        return 1;
+    }
+
+    fprintf(stdout, "capturing.\n");
+    fflush(stdout);
+
+    // SIGUSR1 writes out the trace rings, anything else stops
+    while( sigwait(&set, &sig) == 0 && sig == SIGUSR1 )
+    {
+        if( trace_path && vnc_trace_dump(trace_path) )
+        {
+            fprintf(stdout, "trace written to %s.\n", trace_path);
+            fflush(stdout);
+        }
+    }
+
+    // nothing may scrape a recording once the displays start closing them
+    if( metrics_path )
+    {
+        metrics_stop(metrics_path);
+    }
+
+    // every display hangs up and finishes its recording before anything goes away
+    for( d = displays; d; d = d->next )
+    {
+        __atomic_store_n(&d->vnc.stop, 1, __ATOMIC_RELEASE);
+    }
+    for( d = displays; d; d = d->next )
+    {
+        pthread_join(d->thread, NULL);
+        shm_unlink(d->shm_name);
+    }
+
+    vnc_log_flush();
+    fprintf(stdout, "stopped.\n");
+    return 0;
+}
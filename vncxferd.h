@@ -0,0 +1,56 @@
+#ifndef VNCXFERD_H
+#define VNCXFERD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "vnc.h"
+
+// each display is published as a posix shared memory object named
+// VNC_SHM_PREFIX followed by the display's uuid, e.g. /dev/shm/vncxfer-vm0
+#define VNC_SHM_PREFIX "/vncxfer-"
+#define VNC_SHM_MAGIC 0x58434E56     // 'VNCX'
+#define VNC_SHM_VERSION 3
+#define VNC_SHM_DATA_OFFSET 4096     // pixels start on their own page
+#define VNC_SHM_CURSOR_OFFSET (VNC_SHM_DATA_OFFSET + VNC_BUF_SIZE) // cursor pixels, then its mask
+#define VNC_SHM_CURSOR_MASK (VNC_CURSOR_MAX * VNC_CURSOR_MAX * 4)       // offset of the mask in the cursor area
+#define VNC_SHM_SIZE (VNC_SHM_CURSOR_OFFSET + VNC_SHM_CURSOR_MASK + VNC_CURSOR_MAX * VNC_CURSOR_MAX)
+
+// lives at the start of the shared memory object
+// pixels are decoded straight into the data area, the header only describes them
+// seq is odd from the moment an update starts changing pixels until it is published, so
+// a reader that copies the header and pixels between two reads of the same even seq has
+// a whole frame, otherwise it should retry
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;                // odd while pixels or the header are being written
+    uint32_t readers;            // consumers increment this while attached
+    uint32_t off;                // vm is off, the placeholder is shown
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t pixelsize;
+    uint32_t num_damage;         // rectangles changed by the last published update
+    vnc_rect_t damage[VNC_MAX_DAMAGE];
+    uint64_t frames;             // published updates so far
+    uint64_t timestamp;          // monotonic ns of the last publish
+    uint32_t num_screens;        // guest monitors, since version 2
+    vnc_screen_t screens[VNC_MAX_SCREENS];
+    uint32_t cursor_x;           // pointer position, since version 3
+    uint32_t cursor_y;
+    uint32_t cursor_hotx;
+    uint32_t cursor_hoty;
+    uint32_t cursor_width;       // 0 when there is no shape, like vnc_cursor_t
+    uint32_t cursor_height;
+    uint32_t cursor_serial;      // changes with every new shape
+}
+vnc_shm_header_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,23 @@
+# headless capture daemon, no qt libraries are linked
+# build with: qmake vncxferd.pro && make
+
+CONFIG -= qt
+CONFIG += console
+
+isEmpty(TARGET_NAME) {
+    TARGET_NAME = vncxferd
+}
+TARGET = $$TARGET_NAME
+TEMPLATE = app
+
+include(common.pri)
+
+linux: LIBS += -lrt
+
+SOURCES += \
+    vncxferd.c \
+    $$CORE_SOURCES
+
+HEADERS  += \
+    vncxferd.h \
+    $$CORE_HEADERS
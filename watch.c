@@ -0,0 +1,219 @@
+#include "vnc.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+// a thread blocked until its socket shows up
+typedef struct watch_waiter
+{
+    int wd;                      // inotify watch of the parent directory
+    const char *name;            // socket file name inside that directory
+    int ready;
+    pthread_cond_t cond;
+    struct watch_waiter *next;
+}
+watch_waiter_t;
+
+// one inotify instance and reader thread is shared by every display
+// the per-user inotify instance limit is small, and hundreds of vms are not
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int fd;
+    int started;
+    watch_waiter_t *waiters;
+}
+watch = { PTHREAD_MUTEX_INITIALIZER, 0, -1, 0, NULL };
+
+int vnc_socket_exists(const char *path)
+{
+    struct stat sb;
+    return stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode);
+}
+
+// wakes exactly the waiters whose socket was just created
+static void *watch_thread(void *arg)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    watch_waiter_t *w;
+    ssize_t len;
+    char *ptr;
+
+    (void)arg;
+
+    while( 1 )
+    {
+        len = read(watch.fd, buf, sizeof buf);
+        if( len <= 0 )
+        {
+            if( len < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            fprintf(stderr, "inotify read failed.\n");
+            break;
+        }
+
+        pthread_mutex_lock(&watch.lock);
+        for( ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ev->len )
+        {
+            ev = (const struct inotify_event *)ptr;
+            if( !ev->len )
+            {
+                continue;
+            }
+            for( w = watch.waiters; w; w = w->next )
+            {
+                if( w->wd == ev->wd && !strcmp(w->name, ev->name) )
+                {
+                    w->ready = 1;
+                    pthread_cond_signal(&w->cond);
+                }
+            }
+        }
+        pthread_mutex_unlock(&watch.lock);
+    }
+
+    return NULL;
+}
+
+// lazily bring up the shared watcher, call with the lock held
+static int watch_start(void)
+{
+    if( watch.started )
+    {
+        return watch.fd >= 0;
+    }
+
+    watch.started = 1;
+    watch.fd = inotify_init1(IN_CLOEXEC);
+    if( watch.fd < 0 )
+    {
+        fprintf(stderr, "inotify unavailable, falling back to polling.\n");
+        return 0;
+    }
+
+    if( pthread_create(&watch.thread, NULL, watch_thread, NULL) )
+    {
+        close(watch.fd);
+        watch.fd = -1;
+        return 0;
+    }
+    pthread_detach(watch.thread);
+
+    return 1;
+}
+
+// blocks until the unix socket at path exists or the timeout expires
+// with stale set the socket there is known dead, so only a new one being created counts
+// returns 1 if a socket worth connecting to is there, 0 otherwise
+int vnc_watch_wait(const char *path, int stale, unsigned int timeout_ms)
+{
+    char dir[PATH_MAX];
+    const char *name;
+    watch_waiter_t self, **link;
+    pthread_condattr_t attr;
+    struct timespec deadline;
+    size_t len;
+
+    name = strrchr(path, '/');
+    if( !name )
+    {
+        strcpy(dir, ".");
+        name = path;
+    }
+    else
+    {
+        len = (size_t)(name - path);
+        if( len == 0 )
+        {
+            len = 1;
+        }
+        if( len >= sizeof dir )
+        {
+            vnc_sleep_ms(timeout_ms);
+            return !stale && vnc_socket_exists(path);
+        }
+        memcpy(dir, path, len);
+        dir[len] = 0;
+        name++;
+    }
+
+    pthread_mutex_lock(&watch.lock);
+
+    if( !watch_start() )
+    {
+        pthread_mutex_unlock(&watch.lock);
+        vnc_sleep_ms(timeout_ms);
+        return !stale && vnc_socket_exists(path);
+    }
+
+    // adding the same directory again just hands back the existing watch
+    self.wd = inotify_add_watch(watch.fd, dir, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if( self.wd < 0 )
+    {
+        // the directory itself isn't there yet, nothing to watch
+        pthread_mutex_unlock(&watch.lock);
+        vnc_sleep_ms(timeout_ms);
+        return !stale && vnc_socket_exists(path);
+    }
+
+    // the watch is armed before checking, so a socket created in between still wakes us
+    // a replaced socket is unlinked and created again, which the watch sees as a create
+    if( !stale && vnc_socket_exists(path) )
+    {
+        pthread_mutex_unlock(&watch.lock);
+        return 1;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&self.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    self.name = name;
+    self.ready = 0;
+    self.next = watch.waiters;
+    watch.waiters = &self;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if( deadline.tv_nsec >= 1000000000L )
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while( !self.ready )
+    {
+        if( pthread_cond_timedwait(&self.cond, &watch.lock, &deadline) == ETIMEDOUT )
+        {
+            break;
+        }
+    }
+
+    for( link = &watch.waiters; *link; link = &(*link)->next )
+    {
+        if( *link == &self )
+        {
+            *link = self.next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&watch.lock);
+    pthread_cond_destroy(&self.cond);
+
+    return self.ready || (!stale && vnc_socket_exists(path));
+}